@@ -5,8 +5,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
@@ -28,11 +30,24 @@ struct termios shell_tmodes;
 /* Process group id for the shell */
 pid_t shell_pgid;
 
+/* Launch every program with fork+exec, even where posix_spawn would do (-F) */
+bool force_fork;
+
+/* Whether the shell is running -c or a script file rather than reading stdin */
+bool running_script;
+
+extern char **environ;
+
 // List of defacto commands
 int cmd_exit(struct tokens *tokens);
 int cmd_help(struct tokens *tokens);
 int cmd_cd(struct tokens *tokens);
 int cmd_pwd(struct tokens *tokens);
+int cmd_hash(struct tokens *tokens);
+int cmd_jobs(struct tokens *tokens);
+int cmd_fg(struct tokens *tokens);
+int cmd_bg(struct tokens *tokens);
+int cmd_wait(struct tokens *tokens);
 
 /* Built-in command functions take token array (see parse.h) and return int */
 typedef int cmd_fun_t(struct tokens *tokens);
@@ -51,7 +66,12 @@ fun_desc_t cmd_table[] = {
   {cmd_help, "?", "show this help menu"},
   {cmd_exit, "exit", "exit the command shell"},
   {cmd_cd, "cd", "change the current working directory"},
-  {cmd_pwd, "pwd", "print the current working directory"}
+  {cmd_pwd, "pwd", "print the current working directory"},
+  {cmd_hash, "hash", "list remembered program locations (hash -r forgets them)"},
+  {cmd_jobs, "jobs", "list background and stopped jobs"},
+  {cmd_fg, "fg", "continue a job in the foreground (fg [%n])"},
+  {cmd_bg, "bg", "continue a stopped job in the background (bg [%n])"},
+  {cmd_wait, "wait", "wait for background jobs to finish (wait [%n ...])"}
 };
 
 int cmd_pwd(unused struct tokens * tokens) {
@@ -93,29 +113,172 @@ int lookup(char cmd[]) {
   return -1;
 }
 
-int locateProgramPath(char * name, char * argList[]) {
+/* Remembered program locations, like bash's `hash' table.  Each entry maps a
+ * bare command name to the full path found by searching PATH.  The table is
+ * only valid for the PATH it was filled under, so it is emptied whenever
+ * PATH changes. */
+#define PATH_CACHE_BUCKETS 64
+
+struct pathEntry {
+  char *name;
+  char *path;
+  int hits;
+  struct pathEntry *next;
+};
+
+struct pathEntry *pathCache[PATH_CACHE_BUCKETS];
+
+/* The value of PATH the cache was filled under */
+char *cachedPATH;
+
+unsigned int hashName(const char *name) {
+  unsigned int hash = 5381;
+  while (*name) {
+    hash = hash * 33 + (unsigned char) *name++;
+  }
+  return hash % PATH_CACHE_BUCKETS;
+}
+
+void clearPathCache() {
+  for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+    struct pathEntry *entry = pathCache[i];
+    while (entry != NULL) {
+      struct pathEntry *next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    pathCache[i] = NULL;
+  }
+}
+
+/* Empties the cache if PATH is not what it was filled under. */
+void checkPathChanged() {
+  const char *PATH = getenv("PATH");
+  if (PATH == NULL) {
+    PATH = "";
+  }
+  if (cachedPATH != NULL && strcmp(cachedPATH, PATH) == 0) {
+    return;
+  }
+  clearPathCache();
+  free(cachedPATH);
+  cachedPATH = strdup(PATH);
+}
 
+/* Searches PATH for an executable called NAME.  Returns a malloc'd full path,
+ * or NULL.  Works on a copy so the environment itself is left intact.  Like
+ * execvp, only regular files count: a directory named NAME is skipped. */
+char *locateProgramPath(const char *name) {
   char completePath[4096];
-  char * PATH = getenv("PATH");
+  char *directories = strdup(cachedPATH);
+  char *savePtr;
+  char *found = NULL;
+
+  for (char *dir = strtok_r(directories, ":", &savePtr); dir != NULL;
+       dir = strtok_r(NULL, ":", &savePtr)) {
+    // Build the path directory by directory
+    snprintf(completePath, sizeof(completePath), "%s/%s", *dir ? dir : ".", name);
+    struct stat info;
+    if (access(completePath, X_OK) == 0 && stat(completePath, &info) == 0 &&
+        S_ISREG(info.st_mode)) {
+      found = strdup(completePath);
+      break;
+    }
+  }
 
-  char * token = strtok(PATH, ":");
+  free(directories);
+  return found;
+}
+
+/* Returns the path to exec for NAME: NAME itself if it contains a slash,
+ * otherwise its remembered location, searching PATH on a miss.  Returns
+ * NULL if there is no such program.  The result must not be freed. */
+char *resolveProgram(char *name) {
+  if (strchr(name, '/') != NULL) {
+    return name;
+  }
 
-  while (token != NULL) {
-    // Build the path token by token
-    sprintf(completePath, "%s/%s", token, name);
+  checkPathChanged();
 
-    // Check to see whether the current path is a valid file path
-    // If so, execute this program at this file path
-    int outcome = access(completePath, F_OK);
-    if (outcome != -1) {
-      return execv(completePath, argList);
+  unsigned int bucket = hashName(name);
+  for (struct pathEntry *entry = pathCache[bucket]; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) {
+      entry->hits++;
+      return entry->path;
     }
+  }
+
+  char *path = locateProgramPath(name);
+  if (path == NULL) {
+    return NULL;
+  }
 
-    token = strtok(NULL, ":");
+  struct pathEntry *entry = malloc(sizeof(struct pathEntry));
+  entry->name = strdup(name);
+  entry->path = path;
+  entry->hits = 1;
+  entry->next = pathCache[bucket];
+  pathCache[bucket] = entry;
+  return path;
+}
 
+/* Lists the remembered program locations, or forgets them all with -r */
+int cmd_hash(struct tokens *tokens) {
+  char *option = tokens_get_token(tokens, 1);
+  if (option != NULL && strcmp(option, "-r") == 0) {
+    clearPathCache();
+    return 1;
   }
 
-  return -1;
+  checkPathChanged();
+  int empty = 1;
+  for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+    for (struct pathEntry *entry = pathCache[i]; entry != NULL; entry = entry->next) {
+      if (empty) {
+        printf("hits\tcommand\n");
+        empty = 0;
+      }
+      printf("%4d\t%s\n", entry->hits, entry->path);
+    }
+  }
+  if (empty) {
+    printf("hash: hash table empty\n");
+  }
+  return 1;
+}
+
+/* Builtin lookups already made, keyed by command name, so each distinct
+ * command is matched against cmd_table once.  Builtins never change, so
+ * unlike the path cache this table is never emptied. */
+struct builtinEntry {
+  char *name;
+  int fundex;
+  struct builtinEntry *next;
+};
+
+struct builtinEntry *builtinCache[PATH_CACHE_BUCKETS];
+
+/* Like lookup, but remembers the answer for CMD. */
+int lookupCached(char *cmd) {
+  if (cmd == NULL) {
+    return -1;
+  }
+
+  unsigned int bucket = hashName(cmd);
+  for (struct builtinEntry *entry = builtinCache[bucket]; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->name, cmd) == 0) {
+      return entry->fundex;
+    }
+  }
+
+  struct builtinEntry *entry = malloc(sizeof(struct builtinEntry));
+  entry->name = strdup(cmd);
+  entry->fundex = lookup(cmd);
+  entry->next = builtinCache[bucket];
+  builtinCache[bucket] = entry;
+  return entry->fundex;
 }
 
 void processRedirect(int oldFile, int newFile) {
@@ -123,87 +286,644 @@ void processRedirect(int oldFile, int newFile) {
   close(oldFile);
 }
 
+/* One stage of a pipeline: its argument vector, the program path to exec
+ * (NULL if it could not be found), and optional redirections. */
+struct command {
+  char **argv;
+  char *path;
+  char *inputFile;
+  char *outputFile;
+};
 
-int startProgram(struct tokens * tokens) {
+/* Counts the stages of the pipeline in the first LENGTH TOKENS. */
+int countStages(struct tokens *tokens, int length) {
+  int stages = 1;
+  for (int j = 0; j < length; j++) {
+    if (tokens_is_operator(tokens, j) && strcmp(tokens_get_token(tokens, j), "|") == 0) {
+      stages++;
+    }
+  }
+  return stages;
+}
 
-  int length = tokens_get_length(tokens);
-  if (length == 0) {
-    return -999;
+/* Splits the first LENGTH TOKENS on "|" into COMMANDS, storing each stage's
+ * NULL-terminated argument vector in WORDS (which needs room for length +
+ * stages entries).  Returns false on a syntax error. */
+bool parsePipeline(struct tokens *tokens, int length, struct command commands[], char *words[]) {
+  int stage = 0;
+  int numWords = 0;
+
+  commands[0] = (struct command) {words, NULL, NULL, NULL};
+
+  for (int j = 0; j < length; j++) {
+    char *token = tokens_get_token(tokens, j);
+
+    if (!tokens_is_operator(tokens, j)) {
+      words[numWords++] = token;
+    } else if (strcmp(token, "|") == 0) {
+      if (numWords == commands[stage].argv - words) {
+        fprintf(stderr, "shell: syntax error near '|'\n");
+        return false;
+      }
+      words[numWords++] = NULL;
+      stage++;
+      commands[stage] = (struct command) {&words[numWords], NULL, NULL, NULL};
+    } else if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0) {
+      char *file = ++j < length && !tokens_is_operator(tokens, j) ? tokens_get_token(tokens, j) : NULL;
+      if (file == NULL) {
+        fprintf(stderr, "shell: expected a file name after '%s'\n", token);
+        return false;
+      }
+      if (token[0] == '<') {
+        commands[stage].inputFile = file;
+      } else {
+        commands[stage].outputFile = file;
+      }
+    } else {
+      fprintf(stderr, "shell: syntax error near '%s'\n", token);
+      return false;
+    }
   }
 
-  int status = -999;
-  int processID = fork();
+  if (numWords == commands[stage].argv - words) {
+    fprintf(stderr, "shell: syntax error near '|'\n");
+    return false;
+  }
+  words[numWords] = NULL;
 
-  if (processID == 0) { // in child process
+  // Resolve programs here in the shell, so the lookup is remembered and each
+  // child only has to exec
+  for (int i = 0; i <= stage; i++) {
+    commands[i].path = resolveProgram(commands[i].argv[0]);
+  }
+  return true;
+}
 
-    char * argList[length + 1];
+/* Runs in a freshly forked child: joins process group PGID (or starts one if
+ * PGID is 0), takes the terminal if it leads a FOREGROUND job, wires INPUT
+ * and OUTPUT to stdin/stdout, applies the command's own redirections and
+ * execs it.  Never returns. */
+void execCommand(struct command *command, int input, int output, int unusedFd, pid_t pgid,
+                 bool foreground) {
+  setpgid(0, pgid);
+  if (shell_is_interactive && foreground && pgid == 0) {
+    tcsetpgrp(shell_terminal, getpgrp());
+  }
 
-    int redirectInput = false;
-    int redirectOutput = false; 
-    int numArgs = 0;
+  for (int k = 0; k < 7; k++) {
+    signal(ignoreSignals[k], SIG_DFL);
+  }
 
-    for (int j = 0; j < length; j++) {
-      char * token = tokens_get_token(tokens, j);
+  // The shell launches with SIGCHLD blocked; the program should not inherit that
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
 
-      if (strcmp(token, ">") == 0) {
-        redirectOutput = true;
-      }
+  if (unusedFd >= 0) {
+    close(unusedFd);
+  }
+  if (input != STDIN_FILENO) {
+    processRedirect(input, STDIN_FILENO);
+  }
+  if (output != STDOUT_FILENO) {
+    processRedirect(output, STDOUT_FILENO);
+  }
 
-      else if (strcmp(token, "<") == 0) {
-        redirectInput = true; 
-      }
+  if (command->inputFile) {
+    int fd = open(command->inputFile, O_RDONLY);
+    if (fd < 0) {
+      perror(command->inputFile);
+      _exit(1);
+    }
+    processRedirect(fd, STDIN_FILENO);
+  }
+  if (command->outputFile) {
+    int fd = open(command->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+      perror(command->outputFile);
+      _exit(1);
+    }
+    processRedirect(fd, STDOUT_FILENO);
+  }
 
-      else if (redirectInput) {
-        processRedirect(open(token, O_RDONLY), STDIN_FILENO);
-        redirectInput = false;
-      }
+  if (command->path == NULL) {
+    fprintf(stderr, "%s: command not found\n", command->argv[0]);
+    _exit(127);
+  }
+  execv(command->path, command->argv);
+  perror(command->argv[0]);
+  _exit(126);
+}
+
+/* Launches COMMAND with posix_spawn instead of fork+exec.  posix_spawn
+ * creates the child without copying the shell's page tables, and the file
+ * actions and attributes below do what execCommand does after a fork:
+ * join process group PGID (a new one if PGID is 0), wire INPUT and OUTPUT to
+ * stdin/stdout, apply redirections and restore default signal handling and
+ * an empty signal mask.
+ * Returns the child's pid, or -1 if it could not be started. */
+pid_t spawnCommand(struct command *command, int input, int output, int unusedFd, pid_t pgid) {
+  if (command->path == NULL) {
+    fprintf(stderr, "%s: command not found\n", command->argv[0]);
+    return -1;
+  }
 
-      else if (redirectOutput) {
-        processRedirect(creat(token,  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH), STDIN_FILENO);
-        redirectOutput = false;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (unusedFd >= 0) {
+    posix_spawn_file_actions_addclose(&actions, unusedFd);
+  }
+  if (input != STDIN_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, input);
+  }
+  if (output != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, output);
+  }
+  if (command->inputFile) {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, command->inputFile, O_RDONLY, 0);
+  }
+  if (command->outputFile) {
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->outputFile,
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  }
+
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  for (int k = 0; k < 7; k++) {
+    sigaddset(&defaults, ignoreSignals[k]);
+  }
+  posix_spawnattr_setsigdefault(&attributes, &defaults);
+  posix_spawnattr_setpgroup(&attributes, pgid);
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attributes, &none);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETSIGMASK);
+
+  pid_t processID;
+  int error = posix_spawn(&processID, command->path, &actions, &attributes,
+                          command->argv, environ);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+
+  if (error != 0) {
+    fprintf(stderr, "%s: %s\n", command->argv[0], strerror(error));
+    return -1;
+  }
+  return processID;
+}
+
+/* The job table.  Every pipeline the shell starts is a job: one process
+ * group, with the pid and state of each of its members.  Children are reaped
+ * by the SIGCHLD handler as soon as they exit or stop, so background jobs
+ * never linger as zombies.  The handler only updates process states; the
+ * rest of the shell touches the table with SIGCHLD blocked, and it alone
+ * unlinks and frees finished jobs. */
+enum processState {PROCESS_RUNNING, PROCESS_STOPPED, PROCESS_DONE};
+
+struct job {
+  int id;
+  pid_t pgid;
+  int numProcesses;
+  pid_t *pids;
+  enum processState *states;
+  pid_t lastPid;
+  int status;             /* wait status of the last stage */
+  bool background;
+  char *command;          /* the command line, for jobs, fg and bg */
+  struct termios tmodes;  /* terminal modes to restore when it resumes */
+  struct job *next;
+};
+
+/* All jobs, oldest first */
+struct job *jobs;
+
+void blockChildSignals() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+}
+
+void unblockChildSignals() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/* SIGCHLD handler: collects every child that has exited, stopped or been
+ * continued and records it in its job. */
+void reapChildren(unused int sig) {
+  int savedErrno = errno;
+  int status;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+    for (struct job *job = jobs; job != NULL; job = job->next) {
+      for (int i = 0; i < job->numProcesses; i++) {
+        if (job->pids[i] != pid) {
+          continue;
+        }
+        if (WIFSTOPPED(status)) {
+          job->states[i] = PROCESS_STOPPED;
+        } else if (WIFCONTINUED(status)) {
+          job->states[i] = PROCESS_RUNNING;
+        } else {
+          job->states[i] = PROCESS_DONE;
+          if (pid == job->lastPid) {
+            job->status = status;
+          }
+        }
       }
+    }
+  }
 
-      else if (strcmp(token, "|") == 0) {
-        char * precedingToken = tokens_get_token(tokens, j - 1);
-        char * followingToken = tokens_get_token(tokens, j + 1);
+  errno = savedErrno;
+}
 
-        int p[2];
+bool jobIsRunning(struct job *job) {
+  for (int i = 0; i < job->numProcesses; i++) {
+    if (job->states[i] == PROCESS_RUNNING) {
+      return true;
+    }
+  }
+  return false;
+}
 
-        p[0] = open(precedingToken, "r");
-        p[1] = open(followingToken, "w");
+bool jobIsDone(struct job *job) {
+  for (int i = 0; i < job->numProcesses; i++) {
+    if (job->states[i] != PROCESS_DONE) {
+      return false;
+    }
+  }
+  return true;
+}
 
-        pipe(p);
+const char *jobState(struct job *job) {
+  if (jobIsDone(job)) {
+    return "Done";
+  }
+  return jobIsRunning(job) ? "Running" : "Stopped";
+}
+
+/* Makes an empty job for a pipeline of up to NUM_STAGES processes, labelled
+ * with the text of TOKENS. */
+struct job *newJob(struct tokens *tokens, int numStages, bool background) {
+  size_t length = tokens_get_length(tokens);
+  size_t textLength = 1;
+  for (size_t i = 0; i < length; i++) {
+    textLength += strlen(tokens_get_token(tokens, i)) + 1;
+  }
+
+  struct job *job = calloc(1, sizeof(struct job));
+  job->pids = calloc(numStages, sizeof(pid_t));
+  job->states = calloc(numStages, sizeof(enum processState));
+  job->background = background;
+  job->tmodes = shell_tmodes;
+
+  job->command = malloc(textLength);
+  char *text = job->command;
+  for (size_t i = 0; i < length; i++) {
+    text += sprintf(text, i == 0 ? "%s" : " %s", tokens_get_token(tokens, i));
+  }
+  *text = '\0';
+  return job;
+}
+
+void freeJob(struct job *job) {
+  free(job->pids);
+  free(job->states);
+  free(job->command);
+  free(job);
+}
+
+/* Appends JOB to the table under the next free job number. */
+void addJob(struct job *job) {
+  struct job **link = &jobs;
+  job->id = 1;
+  while (*link != NULL) {
+    job->id = (*link)->id + 1;
+    link = &(*link)->next;
+  }
+  *link = job;
+}
+
+void removeJob(struct job *job) {
+  struct job **link = &jobs;
+  while (*link != job) {
+    link = &(*link)->next;
+  }
+  *link = job->next;
+  freeJob(job);
+}
+
+/* Finds the job named by SPEC ("%n" or "n"), or the most recent job if SPEC
+ * is NULL.  Complains on behalf of builtin NAME if there is none. */
+struct job *findJob(const char *name, const char *spec) {
+  struct job *found = NULL;
+  if (spec == NULL) {
+    for (struct job *job = jobs; job != NULL; job = job->next) {
+      found = job;
+    }
+    if (found == NULL) {
+      fprintf(stderr, "%s: no current job\n", name);
+    }
+    return found;
+  }
+
+  int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+  for (struct job *job = jobs; job != NULL; job = job->next) {
+    if (job->id == id) {
+      return job;
+    }
+  }
+  fprintf(stderr, "%s: %s: no such job\n", name, spec);
+  return NULL;
+}
+
+/* Sleeps until no member of JOB is running any more.  Called with SIGCHLD
+ * blocked, which sigsuspend lifts only while it sleeps, so a child that
+ * changes state between the check and the sleep still wakes us. */
+void waitForJob(struct job *job) {
+  sigset_t mask;
+  sigprocmask(SIG_BLOCK, NULL, &mask);
+  sigdelset(&mask, SIGCHLD);
+  while (jobIsRunning(job)) {
+    sigsuspend(&mask);
+  }
+}
+
+/* Sends SIGCONT to every member of JOB. */
+void continueJob(struct job *job) {
+  for (int i = 0; i < job->numProcesses; i++) {
+    if (job->states[i] == PROCESS_STOPPED) {
+      job->states[i] = PROCESS_RUNNING;
+    }
+  }
+  kill(-job->pgid, SIGCONT);
+}
+
+/* Gives JOB the terminal, continues it if RESUME, and waits until it exits
+ * or stops; then the shell takes the terminal back.  Called with SIGCHLD
+ * blocked.  Returns the wait status of the last stage. */
+int foregroundJob(struct job *job, bool resume) {
+  job->background = false;
+  if (shell_is_interactive) {
+    tcsetpgrp(shell_terminal, job->pgid);
+    if (resume) {
+      tcsetattr(shell_terminal, TCSADRAIN, &job->tmodes);
+    }
+  }
+  if (resume) {
+    continueJob(job);
+  }
+
+  waitForJob(job);
+
+  if (shell_is_interactive) {
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcgetattr(shell_terminal, &job->tmodes);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+  }
+
+  int status = job->status;
+  if (jobIsDone(job)) {
+    removeJob(job);
+  } else {
+    fprintf(stdout, "\n[%d]+  Stopped\t\t%s\n", job->id, job->command);
+  }
+  return status;
+}
+
+/* Forgets every finished job, announcing background ones at an interactive
+ * prompt. */
+void reportJobs() {
+  blockChildSignals();
+  struct job *job = jobs;
+  while (job != NULL) {
+    struct job *next = job->next;
+    if (jobIsDone(job)) {
+      if (shell_is_interactive && job->background) {
+        fprintf(stdout, "[%d]   Done\t\t%s\n", job->id, job->command);
       }
+      removeJob(job);
+    }
+    job = next;
+  }
+  unblockChildSignals();
+}
+
+/* Lists every job and its state */
+int cmd_jobs(unused struct tokens *tokens) {
+  blockChildSignals();
+  struct job *job = jobs;
+  while (job != NULL) {
+    struct job *next = job->next;
+    fprintf(stdout, "[%d]   %-8s\t%s\n", job->id, jobState(job), job->command);
+    if (jobIsDone(job)) {
+      removeJob(job);
+    }
+    job = next;
+  }
+  unblockChildSignals();
+  return 1;
+}
+
+/* Brings a job to the foreground, continuing it if it was stopped */
+int cmd_fg(struct tokens *tokens) {
+  blockChildSignals();
+  struct job *job = findJob("fg", tokens_get_token(tokens, 1));
+  if (job != NULL) {
+    fprintf(stdout, "%s\n", job->command);
+    fflush(stdout);
+    foregroundJob(job, true);
+  }
+  unblockChildSignals();
+  return 1;
+}
+
+/* Continues a stopped job without giving it the terminal */
+int cmd_bg(struct tokens *tokens) {
+  blockChildSignals();
+  struct job *job = findJob("bg", tokens_get_token(tokens, 1));
+  if (job != NULL) {
+    job->background = true;
+    continueJob(job);
+    fprintf(stdout, "[%d]+ %s\n", job->id, job->command);
+  }
+  unblockChildSignals();
+  return 1;
+}
 
-      else {
-        argList[numArgs++] = token;
+/* Waits for the named jobs, or for every job, to finish.  Stopped jobs are
+ * not waited for, since nothing would ever continue them. */
+int cmd_wait(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  blockChildSignals();
+
+  if (length <= 1) {
+    for (struct job *job = jobs; job != NULL; job = job->next) {
+      waitForJob(job);
+    }
+  } else {
+    for (size_t i = 1; i < length; i++) {
+      struct job *job = findJob("wait", tokens_get_token(tokens, i));
+      if (job != NULL) {
+        waitForJob(job);
       }
     }
+  }
 
-    char * programName = argList[0];
-    argList[numArgs] = '\0';
+  // A job that has been waited for is not announced as done afterwards
+  struct job *job = jobs;
+  while (job != NULL) {
+    struct job *next = job->next;
+    if (jobIsDone(job)) {
+      removeJob(job);
+    }
+    job = next;
+  }
 
-    setpgid(0, 0);
-    tcsetpgrp(shell_terminal, getpgrp());
+  unblockChildSignals();
+  return 1;
+}
+
+/* Runs the pipeline in TOKENS as a new job.  Every stage is forked up front,
+ * connected to its neighbours with pipes, and placed in one process group.
+ * Unless the line ends in "&", the group is given the terminal while the
+ * shell waits for it to exit or stop; a background job just runs, and a
+ * non-interactive shell points its stdin at /dev/null so it cannot eat the
+ * script the shell is reading.
+ *
+ * Non-interactive shells launch through posix_spawn.  An interactive shell
+ * keeps fork+exec so each child can take the terminal itself before it
+ * runs, and -F forces fork+exec everywhere.
+ * Returns the wait status of the last stage of a foreground job. */
+int startProgram(struct tokens * tokens) {
 
-    for (int k = 0; k < 7; k++) {
-      signal(ignoreSignals[k], SIG_DFL);
+  int length = tokens_get_length(tokens);
+  bool background = length > 0 && tokens_is_operator(tokens, length - 1) &&
+                    strcmp(tokens_get_token(tokens, length - 1), "&") == 0;
+  if (background) {
+    length--;
+  }
+  if (length == 0) {
+    return -999;
+  }
+
+  int numStages = countStages(tokens, length);
+  struct command commands[numStages];
+  char *words[length + numStages];
+  if (!parsePipeline(tokens, length, commands, words)) {
+    return -999;
+  }
+
+  // Anything builtins printed must come out before the children's output
+  fflush(stdout);
+
+  struct job *job = newJob(tokens, numStages, background);
+  int status = -999;
+  pid_t pgid = 0;
+  pid_t lastPid = -1;
+  int started = 0;
+  int input = STDIN_FILENO;
+  bool useSpawn = !force_fork && !shell_is_interactive;
+
+  if (background && !shell_is_interactive) {
+    input = open("/dev/null", O_RDONLY);
+    if (input < 0) {
+      input = STDIN_FILENO;
     }
+  }
 
-    int outcome = execv(programName, argList);
+  // Hold off the SIGCHLD handler until the job is in the table, so even a
+  // child that exits at once is recorded
+  blockChildSignals();
 
-    if (outcome == -1) {
-      locateProgramPath(programName, argList);
+  for (int i = 0; i < numStages; i++) {
+    int p[2] = {-1, STDOUT_FILENO};
+    if (i < numStages - 1 && pipe(p) < 0) {
+      perror("pipe");
+      break;
     }
-    
-  } 
 
-  // We are in the parent process
-  else {  
-    waitpid(processID, &status, WUNTRACED);
-    tcsetpgrp(shell_terminal, shell_pgid);
+    pid_t processID;
+    if (useSpawn) {
+      processID = spawnCommand(&commands[i], input, p[1], p[0], pgid);
+    } else {
+      processID = fork();
+      if (processID == 0) { // in child process
+        execCommand(&commands[i], input, p[1], p[0], pgid, !background);
+      }
+      if (processID < 0) {
+        perror("fork");
+      }
+    }
+
+    // We are in the parent process
+    if (processID < 0) {
+      if (i == numStages - 1) {
+        status = W_EXITCODE(127, 0);
+      }
+    } else {
+      if (pgid == 0) {
+        pgid = processID;
+        if (shell_is_interactive && !background) {
+          tcsetpgrp(shell_terminal, pgid);
+        }
+      }
+      setpgid(processID, pgid);
+      if (i == numStages - 1) {
+        lastPid = processID;
+      }
+      job->pids[started] = processID;
+      job->states[started] = PROCESS_RUNNING;
+      started++;
+    }
+
+    if (input != STDIN_FILENO) {
+      close(input);
+    }
+    if (p[1] != STDOUT_FILENO) {
+      close(p[1]);
+    }
+    input = p[0];
+
+    // A stage that failed to spawn just leaves its neighbours a closed pipe,
+    // but a failed fork means we are out of processes
+    if (processID < 0 && !useSpawn) {
+      break;
+    }
+  }
+  if (input != STDIN_FILENO && input >= 0) {
+    close(input);
   }
 
+  if (started == 0) {
+    freeJob(job);
+    unblockChildSignals();
+    return status;
+  }
+
+  job->pgid = pgid;
+  job->numProcesses = started;
+  job->lastPid = lastPid;
+  job->status = status;
+  addJob(job);
+
+  if (!background) {
+    status = foregroundJob(job, false);
+  } else if (shell_is_interactive) {
+    fprintf(stdout, "[%d] %d\n", job->id, pgid);
+  }
+
+  unblockChildSignals();
   return status;
 }
 
@@ -213,7 +933,7 @@ void init_shell() {
   shell_terminal = STDIN_FILENO;
 
   /* Check if we are running interactively */
-  shell_is_interactive = isatty(shell_terminal);
+  shell_is_interactive = !running_script && isatty(shell_terminal);
 
   if (shell_is_interactive) {
     /* If the shell is not currently in the foreground, we must pause the shell until it becomes a
@@ -235,32 +955,174 @@ void init_shell() {
   for (int k = 0; k < 7; k++) {
     signal(ignoreSignals[k], SIG_IGN);
   }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = reapChildren;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGCHLD, &action, NULL);
+}
+
+/* Runs one line: the builtin FUNDEX if there is one, otherwise the program.
+ * Returns the wait status of a foreground program, or -999 if the line did
+ * not run one. */
+int runLine(struct tokens *tokens, int fundex) {
+  int status = -999;
+  if (fundex >= 0) {
+    cmd_table[fundex].fun(tokens);
+  } else {
+
+    // We want to actually run the program
+    status = startProgram(tokens);
+  }
+
+  reportJobs();
+  return status;
+}
+
+/* Turns wait status STATUS into an exit code the way sh does: the program's
+ * own exit code, or 128 plus the number of the signal that ended it. */
+int exitCode(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  if (WIFSTOPPED(status)) {
+    return 128 + WSTOPSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+/* Reads all of the file at PATH into a NUL-terminated buffer, in large
+ * chunks.  Returns NULL (having said why) if it cannot be read. */
+char *readScript(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+
+  size_t capacity = 65536;
+  size_t length = 0;
+  char *text = malloc(capacity);
+  ssize_t n;
+  while ((n = read(fd, text + length, capacity - length - 1)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(path);
+      free(text);
+      close(fd);
+      return NULL;
+    }
+    length += n;
+    if (capacity - length - 1 == 0) {
+      capacity *= 2;
+      text = realloc(text, capacity);
+    }
+  }
+  close(fd);
+
+  text[length] = '\0';
+  return text;
 }
 
-int main(unused int argc, unused char *argv[]) {
+/* Runs every line of TEXT, which is cut up in place.  The whole script is
+ * tokenized and its builtins looked up before anything runs, so the
+ * commands themselves run back to back.  Returns the exit code of the last
+ * foreground program, or 0 if there was none. */
+int runScript(char *text) {
+  int numLines = 1;
+  for (char *c = text; *c; c++) {
+    if (*c == '\n') {
+      numLines++;
+    }
+  }
+
+  struct tokens **lines = malloc(sizeof(struct tokens *) * numLines);
+  int *fundexes = malloc(sizeof(int) * numLines);
+
+  char *line = text;
+  for (int i = 0; i < numLines; i++) {
+    char *end = strchr(line, '\n');
+    if (end != NULL) {
+      *end = '\0';
+    }
+    lines[i] = tokenize(line);
+    fundexes[i] = lookupCached(tokens_get_token(lines[i], 0));
+    if (end != NULL) {
+      line = end + 1;
+    }
+  }
+
+  int code = 0;
+  for (int i = 0; i < numLines; i++) {
+    int status = runLine(lines[i], fundexes[i]);
+    if (status != -999) {
+      code = exitCode(status);
+    }
+  }
+
+  for (int i = 0; i < numLines; i++) {
+    tokens_destroy(lines[i]);
+  }
+  free(lines);
+  free(fundexes);
+  return code;
+}
+
+int main(int argc, char *argv[]) {
+  char *command = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "Fc:")) != -1) {
+    if (opt == 'F') {
+      force_fork = true;
+    } else if (opt == 'c') {
+      command = optarg;
+    } else {
+      fprintf(stderr, "usage: %s [-F] [-c command | script]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  char *script = NULL;
+  if (command == NULL && optind < argc) {
+    script = readScript(argv[optind]);
+    if (script == NULL) {
+      return 127;
+    }
+  }
+
+  // A shell running -c or a script file is never interactive, even on a tty
+  running_script = command != NULL || script != NULL;
+
   init_shell();
 
-  static char line[4096];
+  if (running_script) {
+    int code = runScript(command != NULL ? command : script);
+    free(script);
+    return code;
+  }
+
+  char *line = NULL;
+  size_t capacity = 0;
   int line_num = 0;
 
+  if (!shell_is_interactive) {
+    setvbuf(stdin, NULL, _IOFBF, 65536);
+  }
+
   /* Please only print shell prompts when standard input is not a tty */
   if (shell_is_interactive)
     fprintf(stdout, "%d: ", line_num);
 
-  while (fgets(line, 4096, stdin)) {
+  while (getline(&line, &capacity, stdin) > 0) {
     /* Split our line into words. */
     struct tokens *tokens = tokenize(line);
 
     /* Find which built-in function to run. */
-    int fundex = lookup(tokens_get_token(tokens, 0));
-
-    if (fundex >= 0) {
-      cmd_table[fundex].fun(tokens);
-    } else {
-
-      // We want to actually run the program
-      startProgram(tokens);
-    }
+    runLine(tokens, lookupCached(tokens_get_token(tokens, 0)));
 
     if (shell_is_interactive)
       /* Please only print shell prompts when standard input is not a tty */
@@ -270,5 +1132,6 @@ int main(unused int argc, unused char *argv[]) {
     tokens_destroy(tokens);
   }
 
+  free(line);
   return 0;
-}
\ No newline at end of file
+}
@@ -3,25 +3,56 @@
 #include <string.h>
 #include "tokenizer.h"
 
+/* Token pointers and word bytes that fit in the struct itself.  A typical
+ * command line needs nothing else. */
+#define TOKENS_INLINE 16
+#define ARENA_INLINE 512
+
+/* Every word is written NUL-terminated into one arena per line, and tokens
+ * points at the words in it.  Both live inside the struct until a line
+ * outgrows them, and then move to the heap. */
 struct tokens {
   size_t tokens_length;
+  size_t tokens_capacity;
   char **tokens;
-  size_t buffers_length;
-  char **buffers;
+  size_t arena_size;       /* size of a heap arena, 0 while arena is inline */
+  char *arena;
+  char *inline_tokens[TOKENS_INLINE];
+  char inline_arena[ARENA_INLINE];
 };
 
-static void *vector_push(char ***pointer, size_t *size, void *elem) {
-  *pointer = (char**) realloc(*pointer, sizeof(char *) * (*size + 1));
-  (*pointer)[*size] = elem;
-  *size += 1;
-  return elem;
+/* tokens_destroy keeps the last list it was given here, heap buffers and
+ * all, so the next tokenize does not allocate at all.  The shell only ever
+ * has one line in flight. */
+static struct tokens *spare;
+
+static void push_token(struct tokens *tokens, char *word) {
+  if (tokens->tokens_length == tokens->tokens_capacity) {
+    size_t capacity = tokens->tokens_capacity * 2;
+    if (tokens->tokens == tokens->inline_tokens) {
+      tokens->tokens = (char **) malloc(sizeof(char *) * capacity);
+      memcpy(tokens->tokens, tokens->inline_tokens, sizeof(tokens->inline_tokens));
+    } else {
+      tokens->tokens = (char **) realloc(tokens->tokens, sizeof(char *) * capacity);
+    }
+    tokens->tokens_capacity = capacity;
+  }
+  tokens->tokens[tokens->tokens_length++] = word;
 }
 
-static void *copy_word(char *source, size_t n) {
-  source[n] = '\0';
-  char *word = (char *) malloc(n + 1);
-  strncpy(word, source, n + 1);
-  return word;
+/* Characters that are words of their own unless quoted or escaped.  Their
+ * tokens point into this string rather than the arena, which is how
+ * tokens_is_operator tells them from a quoted "|". */
+static const char operators[] = "|\0<\0>\0&";
+
+static const char *find_operator(char c) {
+  switch (c) {
+    case '|': return &operators[0];
+    case '<': return &operators[2];
+    case '>': return &operators[4];
+    case '&': return &operators[6];
+    default: return NULL;
+  }
 }
 
 struct tokens *tokenize(const char *line) {
@@ -29,73 +60,85 @@ struct tokens *tokenize(const char *line) {
     return NULL;
   }
 
-  static char token[4096];
-  size_t n = 0, n_max = 4096;
-  struct tokens *tokens;
-  size_t line_length = strlen(line);
-
-  tokens = (struct tokens *) malloc(sizeof(struct tokens));
+  struct tokens *tokens = spare;
+  spare = NULL;
+  if (tokens == NULL) {
+    tokens = (struct tokens *) malloc(sizeof(struct tokens));
+    tokens->tokens_capacity = TOKENS_INLINE;
+    tokens->tokens = tokens->inline_tokens;
+    tokens->arena_size = 0;
+    tokens->arena = tokens->inline_arena;
+  }
   tokens->tokens_length = 0;
-  tokens->tokens = NULL;
-  tokens->buffers_length = 0;
-  tokens->buffers = NULL;
+
+  /* Each input character adds at most two bytes to the arena: itself and
+   * the NUL ending its word. */
+  size_t line_length = strlen(line);
+  size_t needed = 2 * line_length + 1;
+  if (needed > ARENA_INLINE && needed > tokens->arena_size) {
+    if (tokens->arena_size > 0) {
+      free(tokens->arena);
+    }
+    tokens->arena = (char *) malloc(needed);
+    tokens->arena_size = needed;
+  }
 
   const int MODE_NORMAL = 0,
         MODE_SQUOTE = 1,
         MODE_DQUOTE = 2;
   int mode = MODE_NORMAL;
 
-  for (unsigned int i = 0; i < line_length; i++) {
+  char *out = tokens->arena;
+  char *word = NULL;   /* start of the word being built, if any */
+
+  for (size_t i = 0; i < line_length; i++) {
     char c = line[i];
     if (mode == MODE_NORMAL) {
+      int space = isspace(c);
+      const char *operator = space ? NULL : find_operator(c);
+      if (space || operator != NULL) {
+        if (word != NULL) {
+          *out++ = '\0';
+          push_token(tokens, word);
+          word = NULL;
+        }
+        if (operator != NULL) {
+          push_token(tokens, (char *) operator);
+        }
+        continue;
+      }
+      if (word == NULL) {
+        word = out;
+      }
       if (c == '\'') {
         mode = MODE_SQUOTE;
       } else if (c == '"') {
         mode = MODE_DQUOTE;
-      } else if (c == '\\') {
-        if (i + 1 < line_length) {
-          token[n++] = line[++i];
-        }
-      } else if (isspace(c)) {
-        if (n > 0) {
-          void *word = copy_word(token, n);
-          vector_push(&tokens->tokens, &tokens->tokens_length, word);
-          n = 0;
-        }
+      } else if (c == '\\' && i + 1 < line_length) {
+        *out++ = line[++i];
       } else {
-        token[n++] = c;
+        *out++ = c;
       }
     } else if (mode == MODE_SQUOTE) {
       if (c == '\'') {
         mode = MODE_NORMAL;
-      } else if (c == '\\') {
-        if (i + 1 < line_length) {
-          token[n++] = line[++i];
-        }
       } else {
-        token[n++] = c;
+        *out++ = c;
       }
     } else if (mode == MODE_DQUOTE) {
       if (c == '"') {
         mode = MODE_NORMAL;
-        void *word = copy_word(token, n);
-        vector_push(&tokens->tokens, &tokens->tokens_length, word);
-        n = 0;
-      } else if (c == '\\') {
-        if (i + 1 < line_length) {
-          token[n++] = line[++i];
-        }
+      } else if (c == '\\' && i + 1 < line_length && (line[i + 1] == '"' || line[i + 1] == '\\')) {
+        *out++ = line[++i];
       } else {
-        token[n++] = c;
+        *out++ = c;
       }
     }
-    if (n + 1 >= n_max) abort();
   }
 
-  if (n > 0) {
-    void *word = copy_word(token, n);
-    vector_push(&tokens->tokens, &tokens->tokens_length, word);
-    n = 0;
+  if (word != NULL) {
+    *out++ = '\0';
+    push_token(tokens, word);
   }
   return tokens;
 }
@@ -116,18 +159,24 @@ char *tokens_get_token(struct tokens *tokens, size_t n) {
   }
 }
 
+int tokens_is_operator(struct tokens *tokens, size_t n) {
+  char *token = tokens_get_token(tokens, n);
+  return token != NULL && token >= operators && token < operators + sizeof(operators);
+}
+
 void tokens_destroy(struct tokens *tokens) {
   if (tokens == NULL) {
     return;
   }
-  for (int i = 0; i < tokens->tokens_length; i++) {
-    free(tokens->tokens[i]);
-  }
-  for (int i = 0; i < tokens->buffers_length; i++) {
-    free(tokens->buffers[i]);
+  if (spare == NULL) {
+    spare = tokens;
+    return;
   }
-  if (tokens->tokens) {
+  if (tokens->tokens != tokens->inline_tokens) {
     free(tokens->tokens);
   }
+  if (tokens->arena_size > 0) {
+    free(tokens->arena);
+  }
   free(tokens);
 }
@@ -3,7 +3,8 @@
 /* A struct that represents a list of words. */
 struct tokens;
 
-/* Turn a string into a list of words. */
+/* Turn a string into a list of words.  Unquoted |, <, > and & are words of
+ * their own even without spaces around them. */
 struct tokens *tokenize(const char *line);
 
 /* How many words are there? */
@@ -12,5 +13,8 @@ size_t tokens_get_length(struct tokens *tokens);
 /* Get me the Nth word (zero-indexed) */
 char *tokens_get_token(struct tokens *tokens, size_t n);
 
+/* Is the Nth word an operator (as opposed to, say, a quoted "|")? */
+int tokens_is_operator(struct tokens *tokens, size_t n);
+
 /* Free the memory */
 void tokens_destroy(struct tokens *tokens);
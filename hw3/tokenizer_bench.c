@@ -0,0 +1,45 @@
+/* Times tokenize + tokens_destroy on a few representative command lines and
+ * prints the cost per line.
+ *
+ * Usage: tokenizer_bench [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tokenizer.h"
+
+static const char *sample_lines[] = {
+  "ls -l\n",
+  "cat < input.txt | grep -v '^#' | sort -u > output.txt\n",
+  "gcc -g -Wall -std=gnu99 -c shell.c -o shell.o\n",
+  "echo \"quoted words\" 'and more' escaped\\ space>log.txt&\n",
+  "find . -name '*.c' -newer Makefile | xargs grep -n TODO | sort | uniq -c | sort -rn | "
+  "head -20 > todo.txt\n",
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  int num_lines = sizeof(sample_lines) / sizeof(sample_lines[0]);
+
+  for (int i = 0; i < num_lines; i++) {
+    size_t words = 0;
+    double start = now();
+    for (long k = 0; k < iterations; k++) {
+      struct tokens *tokens = tokenize(sample_lines[i]);
+      words += tokens_get_length(tokens);
+      tokens_destroy(tokens);
+    }
+    double elapsed = now() - start;
+
+    printf("%7.1f ns/line  %2zu words  %s", elapsed * 1e9 / iterations,
+           words / iterations, sample_lines[i]);
+  }
+  return 0;
+}
@@ -1,130 +1,676 @@
 /*
  * mm_alloc.c
+ *
+ * Segregated free-list allocator.  Free blocks live on one of NUM_CLASSES
+ * lists chosen by size, with a bitmap of the non-empty lists so the first
+ * usable class is a find-first-set.  Boundary tags let mm_free merge with
+ * both neighbours in O(1), and the last block of the heap is remembered in
+ * `tail' so growing the heap never walks the block list.
+ *
+ * The heap itself is guarded by heapLock.  Small blocks additionally go
+ * through a per-thread cache (see "Thread caches" below) so the common
+ * malloc/free pair never touches the lock.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more bypass the heap and get their
+ * own mapping, which is unmapped again on free.  Whenever a large free
+ * leaves at least TRIM_THRESHOLD bytes free at the top of the brk heap,
+ * that space is handed back with a negative sbrk.
 */
 
+#define _GNU_SOURCE     // for mremap
+
 #include "mm_alloc.h"
 
+#include <pthread.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 
-struct block {
-    struct block * previous;
-    struct block * next;
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
 
-    size_t size;
-    int free;
-};
+static struct block * freeLists[NUM_CLASSES];
+static uint64_t nonEmpty[CLASS_WORDS];
+
+static struct segment * segments = NULL;
+
+// The epilogue header of the most recent segment, and the block before it
+static struct block * heapEnd = NULL;
+static struct block * tail = NULL;
+
+// Lowest and highest addresses ever covered by a segment
+static char * heapLow = NULL;
+static char * heapHigh = NULL;
+
+
+static inline size_t * footerOf(struct block * b) {
+    return (size_t *) ((char *) b + b->size - FOOTER_SIZE);
+}
+
+static inline void setTags(struct block * b, size_t size, int free) {
+    b->size = size;
+    b->free = free;
+    b->magic = free ? FREE_MAGIC : BLOCK_MAGIC;
+    *footerOf(b) = size | free;
+}
+
+static inline struct block * nextBlock(struct block * b) {
+    return (struct block *) ((char *) b + b->size);
+}
+
+// Returns the block before b, or NULL if b is the first block of its segment
+static inline struct block * previousBlock(struct block * b) {
+    size_t tag = *(size_t *) ((char *) b - FOOTER_SIZE);
+    size_t size = tag & ~(size_t) 1;
+    if (size == 0) {
+        return NULL;
+    }
+    return (struct block *) ((char *) b - size);
+}
+
+static inline int previousIsFree(struct block * b) {
+    return *(size_t *) ((char *) b - FOOTER_SIZE) & 1;
+}
+
+static inline void * payloadOf(struct block * b) {
+    return (char *) b + HEADER_SIZE;
+}
+
+static inline struct block * blockOf(void * ptr) {
+    return (struct block *) ((char *) ptr - HEADER_SIZE);
+}
+
+static inline size_t payloadSize(struct block * b) {
+    return b->size - HEADER_SIZE - FOOTER_SIZE;
+}
+
+// Block size needed to hold a payload of the given size, or 0 on overflow
+static size_t blockSizeFor(size_t size) {
+    if (size > SIZE_MAX / 2) {
+        return 0;
+    }
+    size_t total = ALIGN(size + HEADER_SIZE + FOOTER_SIZE);
+    return total < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : total;
+}
 
-struct block * head = NULL;
+static int sizeClass(size_t size) {
+    if (size <= SMALL_LIMIT) {
+        return (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    }
+
+    int log2 = 63 - __builtin_clzll((unsigned long long) size);
+    int class = NUM_SMALL_CLASSES + log2 - 10;
+    return class < NUM_CLASSES ? class : NUM_CLASSES - 1;
+}
+
+
+static void insertFree(struct block * b) {
+    int class = sizeClass(b->size);
+
+    b->prevFree = NULL;
+    b->nextFree = freeLists[class];
+    if (freeLists[class]) {
+        freeLists[class]->prevFree = b;
+    }
+    freeLists[class] = b;
+    nonEmpty[class / 64] |= 1ULL << (class % 64);
+}
+
+static void removeFree(struct block * b) {
+    int class = sizeClass(b->size);
+
+    if (b->prevFree) {
+        b->prevFree->nextFree = b->nextFree;
+    } else {
+        freeLists[class] = b->nextFree;
+    }
+    if (b->nextFree) {
+        b->nextFree->prevFree = b->prevFree;
+    }
+    if (freeLists[class] == NULL) {
+        nonEmpty[class / 64] &= ~(1ULL << (class % 64));
+    }
+}
+
+// Returns the first class >= class with a non-empty list, or -1
+static int nextNonEmptyClass(int class) {
+    int word = class / 64;
+    uint64_t bits = nonEmpty[word] & (~0ULL << (class % 64));
+
+    while (bits == 0) {
+        if (++word == CLASS_WORDS) {
+            return -1;
+        }
+        bits = nonEmpty[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
 
 
 struct block * findFreeBlock(size_t size) {
-    
-    // Search list for block that is large enough to fit the size
-    struct block * b = head;
-    while (b != NULL) {
-
-        if (b->free) {
-            if (b->size > size) {
-                return b;
+
+    int class = nextNonEmptyClass(sizeClass(size));
+    if (class < 0) {
+        return NULL;
+    }
+
+    // Every block on a small list, or on a larger class than the request's
+    // own, fits.  Only the request's own large class needs a first-fit scan.
+    if (class < NUM_SMALL_CLASSES || class != sizeClass(size)) {
+        return freeLists[class];
+    }
+
+    for (struct block * b = freeLists[class]; b != NULL; b = b->nextFree) {
+        if (b->size >= size) {
+            return b;
+        }
+    }
+
+    class = class + 1 < NUM_CLASSES ? nextNonEmptyClass(class + 1) : -1;
+    return class < 0 ? NULL : freeLists[class];
+}
+
+/*
+ * Merges the free block b with any free neighbours and puts the result on
+ * its free list.  b itself must not be on a free list yet.
+ */
+static struct block * coalesceBlock(struct block * b) {
+    size_t size = b->size;
+
+    struct block * next = nextBlock(b);
+    if (next->free) {
+        removeFree(next);
+        size += next->size;
+        if (next == tail) {
+            tail = b;
+        }
+    }
+
+    if (previousIsFree(b)) {
+        struct block * previous = previousBlock(b);
+        removeFree(previous);
+        size += previous->size;
+        if (b == tail) {
+            tail = previous;
+        }
+        b = previous;
+    }
+
+    setTags(b, size, 1);
+    insertFree(b);
+    return b;
+}
+
+// Trims b down to size bytes and releases the remainder if it is usable
+static void splitBlock(struct block * b, size_t size) {
+    if (b->size - size < MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    struct block * rest = (struct block *) ((char *) b + size);
+    setTags(rest, b->size - size, 1);
+    setTags(b, size, b->free);
+    if (b == tail) {
+        tail = rest;
+    }
+    coalesceBlock(rest);
+}
+
+// Makes b the last block of the current segment and caps it with the epilogue
+static void placeEpilogue(struct block * b) {
+    tail = b;
+    heapEnd = nextBlock(b);
+    heapEnd->size = 0;
+    heapEnd->free = 0;
+    heapEnd->magic = 0;
+}
+
+/*
+ * Grows the heap so that a free block of at least size bytes exists at its
+ * end, and returns that block (not on any free list).  If the break is still
+ * where the last segment left it, the segment is extended in place and a
+ * free tail block only costs the difference; otherwise a new segment starts.
+ */
+static struct block * extendHeap(size_t size) {
+
+    char * brk = sbrk(0);
+
+    if (heapEnd != NULL && brk == (char *) heapEnd + HEADER_SIZE) {
+        struct block * b = heapEnd;
+        size_t grow = size;
+        if (tail != NULL && tail->free) {
+            b = tail;
+            grow = size - tail->size;
+            removeFree(tail);
+        }
+
+        if (sbrk(grow) == (void *) -1) {
+            if (b == tail) {
+                insertFree(tail);
             }
+            return NULL;
+        }
+
+        setTags(b, size, 1);
+        placeEpilogue(b);
+        if ((char *) heapEnd > heapHigh) {
+            heapHigh = (char *) heapEnd;
         }
-        b = b->next;
+        return b;
     }
 
-    return NULL;
+    // Start a new segment, leaving room for its header before the first block
+    char * first = (char *) ALIGN((uintptr_t) brk + sizeof(struct segment));
+    size_t total = (first - brk) + size + HEADER_SIZE;
+    if (sbrk(total) != brk) {
+        return NULL;
+    }
+
+    struct segment * seg = (struct segment *) (first - sizeof(struct segment));
+    seg->next = segments;
+    seg->prologue = 0;
+    segments = seg;
+
+    struct block * b = (struct block *) first;
+    setTags(b, size, 1);
+    placeEpilogue(b);
+
+    if (heapLow == NULL || first < heapLow) {
+        heapLow = first;
+    }
+    if ((char *) heapEnd > heapHigh) {
+        heapHigh = (char *) heapEnd;
+    }
+    return b;
 }
 
-static void * findMallocBlock(size_t size) {
+// Takes a block of at least needed bytes off the heap.  Caller holds heapLock.
+static struct block * allocBlock(size_t needed) {
+    struct block * b = findFreeBlock(needed);
+    if (b != NULL) {
+        removeFree(b);
+    } else {
+        b = extendHeap(needed);
+        if (b == NULL) {
+            return NULL;
+        }
+    }
 
-  struct block * freeBlock = findFreeBlock(size);
+    setTags(b, b->size, 0);
+    splitBlock(b, needed);
+    return b;
+}
 
-  if (freeBlock == NULL) return NULL;
+/*
+ * Gives the free space at the top of the heap back to the OS once there is
+ * at least TRIM_THRESHOLD of it, keeping the break page aligned.  Only
+ * possible while nobody else has moved the break past our epilogue.
+ * Caller holds heapLock.
+ */
+static void trimHeap(void) {
+    if (tail == NULL || !tail->free || tail->size < TRIM_THRESHOLD) {
+        return;
+    }
 
-  // Check if we have to partition the block
-  if (freeBlock->size > sizeof(struct block) + size) {
-    struct block * new = (struct block *) freeBlock + size + sizeof(struct block);
-    new->previous = freeBlock;
-    new->next = freeBlock->next;
+    char * brk = sbrk(0);
+    if (brk != (char *) heapEnd + HEADER_SIZE) {
+        return;
+    }
 
-    new->size = freeBlock->size - sizeof(struct block) - size;
-    new->free = 1;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t keepEnd = (uintptr_t) tail + MIN_BLOCK_SIZE + HEADER_SIZE;
+    char * newBrk = (char *) ((keepEnd + pageSize - 1) & ~(uintptr_t) (pageSize - 1));
+    if (newBrk >= brk) {
+        return;
+    }
 
-    if (freeBlock->next) {
-        freeBlock->next->previous = new; 
+    removeFree(tail);
+    if (sbrk(-(brk - newBrk)) == (void *) -1) {
+        insertFree(tail);
+        return;
     }
 
-    freeBlock->size = size;
-    freeBlock->next = new;
-    freeBlock->free = 0;
+    setTags(tail, newBrk - HEADER_SIZE - (char *) tail, 1);
+    insertFree(tail);
+    placeEpilogue(tail);
+    if (brk - HEADER_SIZE == heapHigh) {
+        heapHigh = (char *) heapEnd;
+    }
+}
 
-  } else { // We don't have to partition the block
-    freeBlock->size = size;
-    freeBlock->free = 0;
-  }
+// Returns an in-use block to the heap.  Caller holds heapLock.
+static void releaseBlock(struct block * b) {
+    setTags(b, b->size, 1);
+    coalesceBlock(b);
+}
 
-  return (void *) freeBlock + sizeof(struct block);
+/*
+ * Tries to grow the in-use block b to needed bytes without moving it, by
+ * absorbing a free right neighbour and, when b ends the heap and the break
+ * is still ours, by pushing the break out.  Caller holds heapLock.
+ */
+static int growInPlace(struct block * b, size_t needed) {
+    struct block * next = nextBlock(b);
+    size_t available = b->size + (next->free ? next->size : 0);
+    int endsHeap = b == tail || (next->free && next == tail);
+
+    if (available < needed) {
+        if (!endsHeap || sbrk(0) != (char *) heapEnd + HEADER_SIZE) {
+            return 0;
+        }
+        if (sbrk(needed - available) == (void *) -1) {
+            return 0;
+        }
+    }
 
+    if (next->free) {
+        removeFree(next);
+    }
+    setTags(b, available < needed ? needed : available, 0);
+    if (endsHeap) {
+        placeEpilogue(b);
+        if ((char *) heapEnd > heapHigh) {
+            heapHigh = (char *) heapEnd;
+        }
+    }
+    splitBlock(b, needed);
+    return 1;
 }
 
-void *mm_malloc(size_t size) {
-    //TODO: Implement malloc
-    if (size == 0) {
+
+/*
+ * Large blocks get a private mapping.  The header sits at the start of the
+ * mapping, so the payload is always HEADER_SIZE bytes past a page boundary,
+ * and there is no footer since a mapped block never has neighbours.
+ */
+static struct block * mapBlock(size_t needed) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t length = (needed + pageSize - 1) & ~(size_t) (pageSize - 1);
+
+    void * region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
         return NULL;
     }
 
-    void * mallocPtr = findMallocBlock(size);
-    if (mallocPtr != NULL) {
-        return mallocPtr; 
+    struct block * b = region;
+    b->size = length;
+    b->free = 0;
+    b->magic = MMAP_MAGIC;
+    return b;
+}
+
+static void unmapBlock(struct block * b) {
+    b->magic = FREE_MAGIC;
+    munmap(b, b->size);
+}
+
+static inline int isMapped(struct block * b) {
+    return b->magic == MMAP_MAGIC;
+}
+
+/*
+ * Resizes a mapped block to needed bytes, returning the (possibly moved)
+ * block or NULL.  Growth goes through mremap, which moves page table
+ * entries instead of copying.  Shrinking unmaps the pages no longer needed.
+ */
+static struct block * remapBlock(struct block * b, size_t needed) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t length = (needed + pageSize - 1) & ~(size_t) (pageSize - 1);
+
+    if (length < b->size) {
+        munmap((char *) b + length, b->size - length);
+    } else if (length > b->size) {
+        void * moved = mremap(b, b->size, length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            return NULL;
+        }
+        b = moved;
+    }
+    b->size = length;
+    return b;
+}
+
+
+/*
+ * Thread caches.
+ *
+ * Each thread keeps a LIFO stack of free blocks per small size class.  To
+ * the heap these blocks still look allocated, so they are never coalesced
+ * while cached.  When a stack grows past TCACHE_MAX, half of it is pushed
+ * as one chain onto that class's shared depot with a CAS; an empty stack
+ * refills by atomically taking the whole depot, and only falls back to the
+ * locked heap when the depot is empty too.  Taking the whole depot with an
+ * exchange (rather than popping single blocks) keeps refill lock-free
+ * without an ABA problem.
+ */
+struct threadCache {
+    struct block * bins[TCACHE_CLASSES];
+    unsigned int counts[TCACHE_CLASSES];
+    int registered;
+};
+
+static TLS_MODEL __thread struct threadCache cache;
+
+static struct block * depot[TCACHE_CLASSES];
+
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+// Pushes the chain first..last (linked through nextFree) onto a depot
+static void depotPush(int class, struct block * first, struct block * last) {
+    struct block * top = __atomic_load_n(&depot[class], __ATOMIC_RELAXED);
+    do {
+        last->nextFree = top;
+    } while (!__atomic_compare_exchange_n(&depot[class], &top, first, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Returns everything in an exiting thread's cache to the heap
+static void flushCache(void * unused) {
+    (void) unused;
+    pthread_mutex_lock(&heapLock);
+    for (int class = 0; class < TCACHE_CLASSES; class++) {
+        struct block * b = cache.bins[class];
+        while (b != NULL) {
+            struct block * next = b->nextFree;
+            releaseBlock(b);
+            b = next;
+        }
+        cache.bins[class] = NULL;
+        cache.counts[class] = 0;
+    }
+    trimHeap();
+    pthread_mutex_unlock(&heapLock);
+    cache.registered = 0;
+}
+
+static void makeCacheKey(void) {
+    pthread_key_create(&cacheKey, flushCache);
+}
+
+// Makes sure the calling thread's cache is flushed when the thread exits
+static void registerCache(void) {
+    pthread_once(&cacheKeyOnce, makeCacheKey);
+    pthread_setspecific(cacheKey, &cache);
+    cache.registered = 1;
+}
+
+// Refills an empty bin, first from the depot and then from the heap
+static int refillCache(int class, size_t size) {
+    struct block * chain = __atomic_exchange_n(&depot[class], NULL, __ATOMIC_ACQUIRE);
+    if (chain != NULL) {
+        unsigned int count = 0;
+        for (struct block * b = chain; b != NULL; b = b->nextFree) {
+            count++;
+        }
+        cache.bins[class] = chain;
+        cache.counts[class] = count;
+        return 1;
     }
 
-    struct block * currentEnd = (struct block *) sbrk(0);
+    // Carve a batch of blocks out of one heap allocation
+    pthread_mutex_lock(&heapLock);
+    struct block * run = allocBlock(size * TCACHE_BATCH);
+    pthread_mutex_unlock(&heapLock);
+    if (run == NULL) {
+        return 0;
+    }
 
-    void * value = sbrk(sizeof(struct block) + size);
-    if (value == (void *) -1) {
-        return NULL; 
+    // Any slack from an unsplittable remainder goes to the last block; a
+    // slightly larger block in the bin is harmless, and it finds its own bin
+    // (or the heap) when freed.
+    char * end = (char *) run + run->size;
+    char * p = (char *) run;
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        struct block * b = (struct block *) p;
+        setTags(b, i == TCACHE_BATCH - 1 ? (size_t) (end - p) : size, 0);
+        b->magic = CACHED_MAGIC;
+        b->nextFree = cache.bins[class];
+        cache.bins[class] = b;
+        p += size;
+    }
+    cache.counts[class] = TCACHE_BATCH;
+    return 1;
+}
+
+static struct block * cacheGet(size_t size) {
+    int class = sizeClass(size);
+
+    if (!cache.registered) {
+        registerCache();
+    }
+    if (cache.bins[class] == NULL && !refillCache(class, size)) {
+        return NULL;
     }
 
-    currentEnd->size = size; 
-    currentEnd->free = 0; 
+    struct block * b = cache.bins[class];
+    cache.bins[class] = b->nextFree;
+    cache.counts[class]--;
+    b->magic = BLOCK_MAGIC;
+    return b;
+}
+
+static void cacheBlockPut(struct block * b) {
+    int class = sizeClass(b->size);
 
-    // insert the struct block into the linked list
-    if (head == NULL) {
-        head = currentEnd;
-    } 
-    else {
+    b->magic = CACHED_MAGIC;
+    b->nextFree = cache.bins[class];
+    cache.bins[class] = b;
 
-        // iterate through the memory linked list to find the last element
-        struct block * b = head;
-        while (b->next != NULL) {
-            b = b->next;
+    if (++cache.counts[class] > TCACHE_MAX) {
+        // Keep the most recently freed half, ship the rest to the depot
+        struct block * last = cache.bins[class];
+        for (int i = 1; i < TCACHE_MAX / 2; i++) {
+            last = last->nextFree;
         }
+        struct block * first = last->nextFree;
+        last->nextFree = NULL;
+        cache.counts[class] = TCACHE_MAX / 2;
+
+        last = first;
+        while (last->nextFree != NULL) {
+            last = last->nextFree;
+        }
+        depotPush(class, first, last);
+    }
+}
 
-        b->next = currentEnd;
-        currentEnd->previous = b;
-        currentEnd->next = NULL;
 
+void *mm_malloc(size_t size) {
+    if (size == 0) {
+        return NULL;
     }
 
-    mallocPtr = (void *) (sizeof(struct block) + currentEnd);
-    bzero(mallocPtr, size);
+    size_t needed = blockSizeFor(size);
+    if (needed == 0) {
+        return NULL;
+    }
+
+    struct block * b;
+    if (needed <= TCACHE_LIMIT) {
+        b = cacheGet(needed);
+    } else if (needed >= MMAP_THRESHOLD) {
+        // Fresh mappings are already zero-filled
+        b = mapBlock(needed);
+        return b == NULL ? NULL : payloadOf(b);
+    } else {
+        pthread_mutex_lock(&heapLock);
+        b = allocBlock(needed);
+        pthread_mutex_unlock(&heapLock);
+    }
+    if (b == NULL) {
+        return NULL;
+    }
 
+    // Zero the whole payload, not just size bytes, so that bytes past what
+    // the caller asked for are always zero (see mm_realloc)
+    void * mallocPtr = payloadOf(b);
+    bzero(mallocPtr, payloadSize(b));
     return mallocPtr;
 }
 
 
+/*
+ * Returns 1 if ptr is a live pointer handed out by mm_malloc.  The default
+ * check is O(1): ptr must be aligned, inside the heap, and have an intact
+ * in-use header.  Building with -DMM_DEBUG additionally checks the footer
+ * and walks the heap to prove ptr starts a block, which is O(n) per call.
+ *
+ * Pointers outside the heap can only be mapped blocks.  Those sit just
+ * past a page boundary, and mincore() confirms the page is mapped before
+ * its header is read.
+ */
 static int checkValidMallocPointer(void * ptr) {
-    struct block * b = head;
-    while (b != NULL) {
-        void * start = (void *) b + sizeof(struct block);
-        if (start == ptr) {
-            return 1;
+    if ((uintptr_t) ptr % ALIGNMENT != 0) {
+        return 0;
+    }
+    if ((char *) ptr < heapLow + HEADER_SIZE || (char *) ptr >= heapHigh) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        if ((uintptr_t) ptr % pageSize != HEADER_SIZE) {
+            return 0;
+        }
+        unsigned char resident;
+        if (mincore(blockOf(ptr), 1, &resident) != 0) {
+            return 0;
+        }
+        return isMapped(blockOf(ptr));
+    }
+
+    struct block * b = blockOf(ptr);
+    if (isMapped(b)) {
+        return 1;
+    }
+    if (b->magic != BLOCK_MAGIC || b->free) {
+        return 0;
+    }
+
+#ifdef MM_DEBUG
+    if (b->size < MIN_BLOCK_SIZE || (char *) b + b->size > heapHigh) {
+        return 0;
+    }
+    if (*footerOf(b) != b->size) {
+        return 0;
+    }
+
+    int found = 0;
+    pthread_mutex_lock(&heapLock);
+    for (struct segment * seg = segments; seg != NULL && !found; seg = seg->next) {
+        struct block * curr = (struct block *) (seg + 1);
+        while (curr->size != 0) {
+            if (curr == b) {
+                found = 1;
+                break;
+            }
+            curr = nextBlock(curr);
         }
-        b = b->next;
     }
-    return 0;
+    pthread_mutex_unlock(&heapLock);
+    return found;
+#else
+    return 1;
+#endif
 }
 
 void *mm_realloc(void *ptr, size_t size) {
@@ -139,87 +685,187 @@ void *mm_realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    checkValidMallocPointer(ptr);
+    if (!checkValidMallocPointer(ptr)) {
+        return NULL;
+    }
 
-    struct block * currBlock = (struct block *) (ptr - sizeof(struct block));
-    struct block * nextBlock = currBlock->next;
+    struct block * currBlock = blockOf(ptr);
+    size_t needed = blockSizeFor(size);
+    if (needed == 0) {
+        return NULL;
+    }
 
-    // Is the currBlock large enough to handle the new size?
-    if (size < ( (void *) nextBlock - (void *) currBlock - sizeof(struct block) ) ) {
+    /*
+     * Every byte of a block past what the caller last asked for is zero:
+     * mm_malloc zeroes whole payloads, shrinking re-zeroes the bytes given
+     * up, and fresh pages from the kernel are zero.  So growing only has to
+     * zero bytes that were never part of this block.
+     */
+    if (isMapped(currBlock)) {
+        size_t oldSize = currBlock->size - HEADER_SIZE;
+        if (needed >= MMAP_THRESHOLD) {
+            struct block * b = remapBlock(currBlock, needed);
+            if (b == NULL) {
+                return NULL;
+            }
+            size_t usable = b->size - HEADER_SIZE;
+            if (size < oldSize) {
+                bzero((char *) payloadOf(b) + size, (usable < oldSize ? usable : oldSize) - size);
+            }
+            return payloadOf(b);
+        }
 
-        // void * start = (void *) (currBlock + size);
-        // bzero(start, currBlock->size - size);
+        // Small enough for the heap now
+        void * newPtr = mm_malloc(size);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        memcpy(newPtr, ptr, size);
+        unmapBlock(currBlock);
+        return newPtr;
+    }
 
-        currBlock->size = size;
+    size_t oldSize = payloadSize(currBlock);
+    if (needed >= MMAP_THRESHOLD && needed > currBlock->size) {
+        void * newPtr = mm_malloc(size);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        memcpy(newPtr, ptr, oldSize);
+        mm_free(ptr);
+        return newPtr;
+    }
 
+    pthread_mutex_lock(&heapLock);
+    int inPlace;
+    if (needed <= currBlock->size) {
+        splitBlock(currBlock, needed);
+        inPlace = 1;
+    } else {
+        inPlace = growInPlace(currBlock, needed);
+    }
+    pthread_mutex_unlock(&heapLock);
+
+    if (inPlace) {
+        size_t newSize = payloadSize(currBlock);
+        if (newSize > oldSize) {
+            bzero((char *) ptr + oldSize, newSize - oldSize);
+        } else if (size < newSize) {
+            bzero((char *) ptr + size, newSize - size);
+        }
         return ptr;
     }
 
-    // Otherwise allocate a new block with the new size 
-    struct block * newBlock = mm_malloc(size);
-    if (newBlock == NULL) {
-        return NULL;
+    /*
+     * Moving is O(n), so ask for 50% headroom: a buffer that keeps growing by
+     * small appends then moves O(log n) times and grows in place in between.
+     */
+    size_t request = oldSize + oldSize / 2;
+    if (request < size || blockSizeFor(request) >= MMAP_THRESHOLD) {
+        request = size;
     }
+    size_t requestNeeded = blockSizeFor(request);
 
-    // Zero fill this new block with 0s
-    void * startPtr = (void *) (sizeof(struct block) + newBlock);
-    bzero(startPtr, size);
+    struct block * b;
+    pthread_mutex_lock(&heapLock);
+    b = allocBlock(requestNeeded);
+    pthread_mutex_unlock(&heapLock);
+    if (b == NULL) {
+        return NULL;
+    }
 
-    // Copy over data to this new block
-    memcpy(startPtr, ptr, currBlock->size);
+    // Copy the old contents, and zero only what the copy did not cover
+    void * newPtr = payloadOf(b);
+    memcpy(newPtr, ptr, oldSize);
+    bzero((char *) newPtr + oldSize, payloadSize(b) - oldSize);
 
-    // Free the original pointer at the end
     mm_free(ptr);
 
-    return newBlock;
+    return newPtr;
 }
 
 
-void coalesceBlock(struct block * currBlock) {
-
-    if (currBlock->previous && currBlock->previous->free == 1) {
-        currBlock->previous->next = currBlock->next;
-        currBlock->previous->size += currBlock->size + sizeof(struct block);
+void mm_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    int val = checkValidMallocPointer(ptr);
+    if (val == 0) {
+        return;
+    }
 
-        if (currBlock->next) {
-            currBlock->next->previous = currBlock->previous;
+    struct block * currBlock = blockOf(ptr);
+    if (currBlock->size <= TCACHE_LIMIT) {
+        if (!cache.registered) {
+            registerCache();
         }
+        cacheBlockPut(currBlock);
+        return;
+    }
 
-        // struct block * previousBlock = currBlock->next;
-        // void * ptr = previousBlock + sizeof(struct block);
-        // bzero(ptr, previousBlock->size);
-    
+    if (isMapped(currBlock)) {
+        unmapBlock(currBlock);
+        return;
     }
 
-    
+    pthread_mutex_lock(&heapLock);
+    releaseBlock(currBlock);
+    trimHeap();
+    pthread_mutex_unlock(&heapLock);
 }
 
 
-void mm_free(void *ptr) {
-    if (ptr == NULL) {
-        return;
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return mm_malloc(size);
     }
-    int val = checkValidMallocPointer(ptr);
-    if (val == 0) {
-        return;
+    if ((alignment & (alignment - 1)) != 0 || size == 0) {
+        return NULL;
     }
 
-    // Get the current block and set it all equal to 0s
-    struct block * currBlock = (struct block *) (ptr - sizeof(struct block));
-    currBlock->free = 1; 
-    // bzero(ptr, currBlock->size);
+    size_t needed = blockSizeFor(size);
+    if (needed == 0 || needed > SIZE_MAX / 2 - alignment) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    struct block * b = allocBlock(needed + alignment + MIN_BLOCK_SIZE);
+    if (b == NULL) {
+        pthread_mutex_unlock(&heapLock);
+        return NULL;
+    }
 
-    // Get the next block for coalescing
-    struct block * nextBlock = currBlock->next;
+    // Free a leading block big enough to stand on its own so the payload
+    // after it lands on the requested boundary
+    char * payload = payloadOf(b);
+    char * aligned = (char *) (((uintptr_t) payload + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (aligned != payload) {
+        if ((size_t) (aligned - payload) < MIN_BLOCK_SIZE) {
+            aligned += alignment;
+        }
+        size_t gap = aligned - payload;
+        struct block * alignedBlock = blockOf(aligned);
+        setTags(alignedBlock, b->size - gap, 0);
+        if (b == tail) {
+            tail = alignedBlock;
+        }
+        setTags(b, gap, 1);
+        coalesceBlock(b);
+        b = alignedBlock;
+    }
+    splitBlock(b, needed);
+    pthread_mutex_unlock(&heapLock);
 
-    // Check the previous block and the next block 
-    struct block * previousBlock = currBlock->previous;
+    bzero(aligned, payloadSize(b));
+    return aligned;
+}
 
-    if (previousBlock != NULL && previousBlock->free == 1) {
-       // coalesceBlock(currBlock);
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL || !checkValidMallocPointer(ptr)) {
+        return 0;
     }
-    if (nextBlock != NULL && nextBlock->free == 1) {
-       // coalesceBlock(nextBlock); 
+    if (isMapped(blockOf(ptr))) {
+        return blockOf(ptr)->size - HEADER_SIZE;
     }
-
-}
\ No newline at end of file
+    return payloadSize(blockOf(ptr));
+}
@@ -9,12 +9,96 @@
 #ifndef _malloc_H_
 #define _malloc_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 void* mm_malloc(size_t size);
 void* mm_realloc(void* ptr, size_t size);
 void mm_free(void* ptr);
 
-//TODO: Add any implementation details you might need to this file
+// Extras used by the LD_PRELOAD wrappers in mm_preload.c
+void* mm_memalign(size_t alignment, size_t size);
+size_t mm_usable_size(void* ptr);
+
+/*
+ * Every block starts with a header and ends with a one-word footer holding
+ * the same size (the boundary tag), so both neighbours of a block can be
+ * found in O(1).  The prevFree/nextFree links overlay the payload and are
+ * only meaningful while the block sits on a free list.
+ *
+ * magic is BLOCK_MAGIC exactly while the block is handed out, which is what
+ * mm_free and mm_realloc check instead of searching the heap.
+ */
+struct block {
+    size_t size;     // total bytes in the block, header and footer included
+    uint32_t free;
+    uint32_t magic;
+
+    struct block * prevFree;
+    struct block * nextFree;
+};
+
+/*
+ * Each run of memory obtained from sbrk is a segment.  The segment header
+ * sits right before the first block; its last word doubles as an allocated
+ * "prologue" footer so coalescing never walks off the front.  The segment
+ * ends with an allocated zero-size "epilogue" header.
+ */
+struct segment {
+    struct segment * next;
+    size_t prologue;
+};
+
+#define BLOCK_MAGIC 0x6d6d616cU
+#define FREE_MAGIC 0x66726565U
+#define CACHED_MAGIC 0x74636863U
+#define MMAP_MAGIC 0x6d6d6170U
+
+#define ALIGNMENT 16
+#define ALIGN(x) (((x) + (ALIGNMENT - 1)) & ~((size_t) ALIGNMENT - 1))
+
+#define HEADER_SIZE offsetof(struct block, prevFree)
+#define FOOTER_SIZE sizeof(size_t)
+#define MIN_BLOCK_SIZE ALIGN(sizeof(struct block) + FOOTER_SIZE)
+
+/*
+ * Size classes.  Block sizes up to SMALL_LIMIT get one exact class per
+ * ALIGNMENT step, so any block on a non-empty small list fits.  Larger
+ * blocks are grouped by power of two.
+ */
+#define SMALL_LIMIT 1024
+#define NUM_SMALL_CLASSES ((SMALL_LIMIT - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define NUM_LARGE_CLASSES 22
+#define NUM_CLASSES (NUM_SMALL_CLASSES + NUM_LARGE_CLASSES)
+#define CLASS_WORDS ((NUM_CLASSES + 63) / 64)
+
+/*
+ * Per-thread caches hold blocks up to TCACHE_LIMIT bytes, one bin per small
+ * size class.  A bin refills TCACHE_BATCH blocks at a time from the heap and
+ * spills half of itself to the shared depot once it holds TCACHE_MAX.
+ */
+#define TCACHE_LIMIT 256
+#define TCACHE_CLASSES ((TCACHE_LIMIT - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define TCACHE_BATCH 16
+#define TCACHE_MAX 64
+
+/*
+ * Blocks of MMAP_THRESHOLD bytes or more get their own mapping.  The top of
+ * the brk heap is returned to the OS once TRIM_THRESHOLD bytes there are free.
+ */
+#define MMAP_THRESHOLD (128 * 1024)
+#define TRIM_THRESHOLD (128 * 1024)
+
+/*
+ * The preload build is loaded at startup, so its thread cache can use the
+ * cheaper initial-exec TLS model (and never calls back into malloc to set
+ * up TLS).  A dlopen'd copy must use the default model.
+ */
+#ifdef MM_PRELOAD
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define TLS_MODEL
+#endif
 
 #endif
@@ -0,0 +1,620 @@
+/*
+ * mm_bench.c
+ *
+ * Allocator benchmark and trace replayer.  Loads mm_malloc/mm_realloc/
+ * mm_free from a shared library (hw3lib.so by default) the same way mm_test
+ * does, or uses the C library's allocator when the library is "libc".
+ *
+ * Usage: mm_bench [-l library.so | -l libc] [-t threads] [-n ops] workload
+ *
+ * Workloads:
+ *   churn           every thread randomly mallocs into and frees out of a
+ *                   private table of slots
+ *   prodcons        threads pair up; one side mallocs, the other frees
+ *   realloc         buffers grow by small appends through mm_realloc, the
+ *                   way word_helpers grows its word buffer
+ *   trace FILE      replays a recorded trace (see below), single-threaded
+ *
+ * A trace has one call per line, with pointers written as hex ids:
+ *   m <id> <size>           malloc returned id
+ *   r <old> <new> <size>    realloc of old (0 for NULL) returned new
+ *   f <id>                  free
+ * mm_preload.so writes this format when MM_TRACE names an output file, so
+ *   MM_TRACE=pwords.trace LD_PRELOAD=./mm_preload.so ../hw2/pwords ...
+ * records a trace of a real program.
+ *
+ * Each workload runs twice, each time in a fresh child process so both
+ * runs start from an empty heap.  The first run is untimed per call and
+ * gives ops/sec.  The second times every call and samples memory use; it
+ * reports the latency distribution per call type, the peak heap footprint
+ * (growth in resident memory) and the fragmentation ratio, which is peak
+ * footprint over peak live requested bytes.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS 1024
+#define RING_SIZE 256
+#define SAMPLE_INTERVAL 256
+#define BUCKETS 40
+
+void* (*mm_malloc)(size_t);
+void* (*mm_realloc)(void*, size_t);
+void (*mm_free)(void*);
+
+enum call { CALL_MALLOC, CALL_REALLOC, CALL_FREE, NUM_CALLS };
+static const char *callNames[NUM_CALLS] = { "malloc", "realloc", "free" };
+
+/* Latency histogram: bucket i counts calls that took [2^i, 2^(i+1)) ns. */
+struct stats {
+    long counts[NUM_CALLS][BUCKETS];
+    long calls[NUM_CALLS];
+    long long totalNs[NUM_CALLS];
+    long long maxNs[NUM_CALLS];
+};
+
+struct traceOp {
+    char kind;
+    uint64_t id;
+    uint64_t newId;
+    size_t size;
+};
+
+static const char *library = "hw3lib.so";
+static const char *workload = NULL;
+static int numThreads = 4;
+static long opsPerThread = 1000000;
+
+static struct traceOp *trace;
+static long traceLength;
+
+/* Settings for the current run */
+static int profiling;
+static long liveBytes;
+static long peakLiveBytes;
+static long baselineResident;
+static long peakResident;
+static int statmFd = -1;
+
+void load_alloc_functions() {
+    if (strcmp(library, "libc") == 0) {
+        mm_malloc = malloc;
+        mm_realloc = realloc;
+        mm_free = free;
+        return;
+    }
+
+    void *handle = dlopen(library, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    char* error;
+    mm_malloc = dlsym(handle, "mm_malloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    mm_realloc = dlsym(handle, "mm_realloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    mm_free = dlsym(handle, "mm_free");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+}
+
+/* Harness memory comes straight from mmap so it never shows up in (or
+ * perturbs) the allocator under test. */
+static void *harnessAlloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long residentBytes(void) {
+    char buf[64];
+    long size, resident;
+    ssize_t n = pread(statmFd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+        return 0;
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void record(struct stats *st, enum call call, long long ns) {
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && (1LL << (bucket + 1)) <= ns) {
+        bucket++;
+    }
+    st->counts[call][bucket]++;
+    st->calls[call]++;
+    st->totalNs[call] += ns;
+    if (ns > st->maxNs[call]) {
+        st->maxNs[call] = ns;
+    }
+}
+
+/* Tracks live requested bytes and, every SAMPLE_INTERVAL calls, the
+ * resident footprint.  Only used while profiling. */
+static void account(long delta, long *callCount) {
+    long live = __atomic_add_fetch(&liveBytes, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&peakLiveBytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peakLiveBytes, &peak, live, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if (++*callCount % SAMPLE_INTERVAL == 0) {
+        long resident = residentBytes();
+        long seen = __atomic_load_n(&peakResident, __ATOMIC_RELAXED);
+        while (resident > seen && !__atomic_compare_exchange_n(&peakResident, &seen, resident, 1,
+                                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+/* Wrappers that time and account each call when profiling. */
+struct worker {
+    struct stats stats;
+    long callCount;
+    unsigned int seed;
+    long index;
+};
+
+static void *benchMalloc(struct worker *w, size_t size) {
+    if (!profiling) {
+        return mm_malloc(size);
+    }
+    long long start = nowNs();
+    void *p = mm_malloc(size);
+    record(&w->stats, CALL_MALLOC, nowNs() - start);
+    account(size, &w->callCount);
+    return p;
+}
+
+static void *benchRealloc(struct worker *w, void *ptr, size_t oldSize, size_t size) {
+    if (!profiling) {
+        return mm_realloc(ptr, size);
+    }
+    long long start = nowNs();
+    void *p = mm_realloc(ptr, size);
+    record(&w->stats, CALL_REALLOC, nowNs() - start);
+    account((long) size - (long) oldSize, &w->callCount);
+    return p;
+}
+
+static void benchFree(struct worker *w, void *ptr, size_t size) {
+    if (!profiling) {
+        mm_free(ptr);
+        return;
+    }
+    long long start = nowNs();
+    mm_free(ptr);
+    record(&w->stats, CALL_FREE, nowNs() - start);
+    account(-(long) size, &w->callCount);
+}
+
+static void *checked(void *p, size_t size) {
+    if (p == NULL) {
+        fprintf(stderr, "allocation of %zu bytes failed\n", size);
+        exit(1);
+    }
+    *(char *) p = 1;
+    return p;
+}
+
+static size_t randomSize(unsigned int *seed) {
+    return rand_r(seed) % 64 == 0 ? rand_r(seed) % 4096 + 1 : rand_r(seed) % 200 + 1;
+}
+
+
+/* Randomly mallocs into or frees out of a private table of slots.  Most
+ * requests are small; one in 64 is up to 4 KiB. */
+static void *churn(void *arg) {
+    struct worker *w = arg;
+    void *slots[SLOTS] = { NULL };
+    size_t sizes[SLOTS];
+
+    for (long i = 0; i < opsPerThread; i++) {
+        int slot = rand_r(&w->seed) % SLOTS;
+        if (slots[slot] != NULL) {
+            benchFree(w, slots[slot], sizes[slot]);
+            slots[slot] = NULL;
+        } else {
+            sizes[slot] = randomSize(&w->seed);
+            slots[slot] = checked(benchMalloc(w, sizes[slot]), sizes[slot]);
+        }
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            benchFree(w, slots[slot], sizes[slot]);
+        }
+    }
+    return NULL;
+}
+
+/* Producer/consumer: even workers malloc into a ring, odd workers free out
+ * of their partner's ring, so every block is freed by another thread. */
+struct ring {
+    void *items[RING_SIZE];
+    size_t sizes[RING_SIZE];
+    long head;
+    long tail;
+};
+
+static struct ring *rings;
+
+static void *produceConsume(void *arg) {
+    struct worker *w = arg;
+    struct ring *ring = &rings[w->index / 2];
+
+    for (long i = 0; i < opsPerThread; i++) {
+        if (w->index % 2 == 0) {
+            while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+                sched_yield();
+            }
+            size_t size = randomSize(&w->seed);
+            ring->sizes[i % RING_SIZE] = size;
+            ring->items[i % RING_SIZE] = checked(benchMalloc(w, size), size);
+            __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+        } else {
+            while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) <= i) {
+                sched_yield();
+            }
+            benchFree(w, ring->items[i % RING_SIZE], ring->sizes[i % RING_SIZE]);
+            __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/* Grows a handful of live buffers by small appends, then frees the biggest
+ * and starts it over, like repeated calls to get_word. */
+static void *reallocGrowth(void *arg) {
+    struct worker *w = arg;
+    enum { BUFFERS = 8, MAX_LENGTH = 64 * 1024 };
+    char *buffers[BUFFERS] = { NULL };
+    size_t sizes[BUFFERS] = { 0 };
+
+    for (long i = 0; i < opsPerThread; i++) {
+        int b = rand_r(&w->seed) % BUFFERS;
+        if (sizes[b] >= MAX_LENGTH) {
+            benchFree(w, buffers[b], sizes[b]);
+            buffers[b] = NULL;
+            sizes[b] = 0;
+            continue;
+        }
+        size_t size = sizes[b] + rand_r(&w->seed) % 32 + 1;
+        buffers[b] = checked(benchRealloc(w, buffers[b], sizes[b], size), size);
+        buffers[b][size - 1] = (char) i;
+        sizes[b] = size;
+    }
+
+    for (int b = 0; b < BUFFERS; b++) {
+        if (buffers[b] != NULL) {
+            benchFree(w, buffers[b], sizes[b]);
+        }
+    }
+    return NULL;
+}
+
+
+/* Open-addressing map from trace ids to replayed pointers. */
+struct liveEntry {
+    uint64_t id;
+    void *ptr;
+    size_t size;
+};
+
+static struct liveEntry *liveTable;
+static size_t liveCapacity;
+
+static struct liveEntry *lookup(uint64_t id, int insert) {
+    size_t i = (id * 0x9e3779b97f4a7c15ULL >> 17) & (liveCapacity - 1);
+    while (liveTable[i].id != 0) {
+        if (liveTable[i].id == id) {
+            return &liveTable[i];
+        }
+        i = (i + 1) & (liveCapacity - 1);
+    }
+    if (!insert) {
+        return NULL;
+    }
+    liveTable[i].id = id;
+    return &liveTable[i];
+}
+
+/* Removes an entry, re-inserting the rest of its probe run. */
+static void forget(struct liveEntry *entry) {
+    size_t i = entry - liveTable;
+    entry->id = 0;
+    for (i = (i + 1) & (liveCapacity - 1); liveTable[i].id != 0; i = (i + 1) & (liveCapacity - 1)) {
+        struct liveEntry moved = liveTable[i];
+        liveTable[i].id = 0;
+        *lookup(moved.id, 1) = moved;
+    }
+}
+
+static void *replayTrace(void *arg) {
+    struct worker *w = arg;
+
+    for (long i = 0; i < traceLength; i++) {
+        struct traceOp *op = &trace[i];
+        struct liveEntry *entry;
+
+        switch (op->kind) {
+        case 'm':
+            entry = lookup(op->id, 1);
+            entry->ptr = checked(benchMalloc(w, op->size), op->size);
+            entry->size = op->size;
+            break;
+        case 'r': {
+            entry = op->id != 0 ? lookup(op->id, 0) : NULL;
+            void *old = entry != NULL ? entry->ptr : NULL;
+            size_t oldSize = entry != NULL ? entry->size : 0;
+            void *p = benchRealloc(w, old, oldSize, op->size);
+            if (entry != NULL) {
+                forget(entry);
+            }
+            if (op->newId != 0 && op->size != 0) {
+                entry = lookup(op->newId, 1);
+                entry->ptr = checked(p, op->size);
+                entry->size = op->size;
+            }
+            break;
+        }
+        case 'f':
+            entry = lookup(op->id, 0);
+            if (entry != NULL) {
+                benchFree(w, entry->ptr, entry->size);
+                forget(entry);
+            }
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < liveCapacity; i++) {
+        if (liveTable[i].id != 0) {
+            benchFree(w, liveTable[i].ptr, liveTable[i].size);
+            liveTable[i].id = 0;
+        }
+    }
+    return NULL;
+}
+
+static void loadTrace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    long capacity = 1 << 16;
+    trace = harnessAlloc(capacity * sizeof(struct traceOp));
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct traceOp op = { line[0], 0, 0, 0 };
+        int ok = 0;
+        if (op.kind == 'm') {
+            ok = sscanf(line + 1, "%lx %zu", &op.id, &op.size) == 2;
+        } else if (op.kind == 'r') {
+            ok = sscanf(line + 1, "%lx %lx %zu", &op.id, &op.newId, &op.size) == 3;
+        } else if (op.kind == 'f') {
+            ok = sscanf(line + 1, "%lx", &op.id) == 1;
+        }
+        if (!ok) {
+            continue;
+        }
+
+        if (traceLength == capacity) {
+            struct traceOp *bigger = harnessAlloc(2 * capacity * sizeof(struct traceOp));
+            memcpy(bigger, trace, capacity * sizeof(struct traceOp));
+            munmap(trace, capacity * sizeof(struct traceOp));
+            trace = bigger;
+            capacity *= 2;
+        }
+        trace[traceLength++] = op;
+    }
+    fclose(file);
+
+    for (liveCapacity = 1024; liveCapacity < (size_t) traceLength; liveCapacity *= 2) {
+    }
+    liveTable = harnessAlloc(liveCapacity * sizeof(struct liveEntry));
+}
+
+
+static long percentile(long *counts, long total, double fraction) {
+    long seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if (seen >= total * fraction) {
+            return 1L << (bucket + 1);
+        }
+    }
+    return 1L << BUCKETS;
+}
+
+static void report(struct stats *total) {
+    printf("  %-8s %10s %10s %10s %10s %10s %12s\n",
+           "call", "count", "mean ns", "p50 <ns", "p99 <ns", "p99.9 <ns", "max ns");
+    for (int call = 0; call < NUM_CALLS; call++) {
+        long n = total->calls[call];
+        if (n == 0) {
+            continue;
+        }
+        printf("  %-8s %10ld %10.0f %10ld %10ld %10ld %12lld\n", callNames[call], n,
+               (double) total->totalNs[call] / n,
+               percentile(total->counts[call], n, 0.50),
+               percentile(total->counts[call], n, 0.99),
+               percentile(total->counts[call], n, 0.999),
+               total->maxNs[call]);
+    }
+
+    long footprint = peakResident - baselineResident;
+    printf("  peak live %ld KiB, peak footprint %ld KiB, fragmentation ratio %.2f\n",
+           peakLiveBytes / 1024, footprint / 1024,
+           peakLiveBytes > 0 ? (double) footprint / peakLiveBytes : 0.0);
+}
+
+/* Runs the workload once in this (child) process. */
+static void runWorkload(void) {
+    void *(*body)(void *);
+    int threads = numThreads;
+
+    if (strcmp(workload, "churn") == 0) {
+        body = churn;
+    } else if (strcmp(workload, "prodcons") == 0) {
+        body = produceConsume;
+        threads = numThreads < 2 ? 2 : numThreads & ~1;
+        rings = harnessAlloc(threads / 2 * sizeof(struct ring));
+    } else if (strcmp(workload, "realloc") == 0) {
+        body = reallocGrowth;
+    } else {
+        body = replayTrace;
+        threads = 1;
+    }
+
+    load_alloc_functions();
+
+    struct worker *workers = harnessAlloc(threads * sizeof(struct worker));
+    pthread_t *ids = harnessAlloc(threads * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++) {
+        workers[t].seed = t + 1;
+        workers[t].index = t;
+    }
+
+    statmFd = open("/proc/self/statm", O_RDONLY);
+    baselineResident = peakResident = residentBytes();
+
+    long long start = nowNs();
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, body, &workers[t]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    struct stats *total = harnessAlloc(sizeof(struct stats));
+    long ops = 0;
+    for (int t = 0; t < threads; t++) {
+        for (int call = 0; call < NUM_CALLS; call++) {
+            for (int bucket = 0; bucket < BUCKETS; bucket++) {
+                total->counts[call][bucket] += workers[t].stats.counts[call][bucket];
+            }
+            total->calls[call] += workers[t].stats.calls[call];
+            total->totalNs[call] += workers[t].stats.totalNs[call];
+            if (workers[t].stats.maxNs[call] > total->maxNs[call]) {
+                total->maxNs[call] = workers[t].stats.maxNs[call];
+            }
+        }
+    }
+
+    if (profiling) {
+        report(total);
+    } else {
+        ops = body == replayTrace ? traceLength : opsPerThread * threads;
+        printf("%s %s: %d threads, %ld ops in %.3f s, %.0f ops/sec\n",
+               library, workload, threads, ops, seconds, ops / seconds);
+    }
+}
+
+static void runInChild(int profile) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        profiling = profile;
+        runWorkload();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "benchmark run failed\n");
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mm_bench [-l library.so | -l libc] [-t threads] [-n ops] "
+                    "churn | prodcons | realloc | trace FILE\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:t:n:")) != -1) {
+        switch (opt) {
+        case 'l':
+            library = optarg;
+            break;
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case 'n':
+            opsPerThread = atol(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || numThreads < 1) {
+        usage();
+    }
+
+    workload = argv[optind];
+    if (strcmp(workload, "trace") == 0) {
+        if (optind + 1 >= argc) {
+            usage();
+        }
+        loadTrace(argv[optind + 1]);
+    } else if (strcmp(workload, "churn") != 0 && strcmp(workload, "prodcons") != 0
+               && strcmp(workload, "realloc") != 0) {
+        usage();
+    }
+
+    runInChild(0);
+    runInChild(1);
+    return 0;
+}
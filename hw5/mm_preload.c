@@ -0,0 +1,139 @@
+/*
+ * mm_preload.c
+ *
+ * Exports the standard allocator entry points on top of mm_alloc so any
+ * program can run on it without relinking:
+ *
+ *     LD_PRELOAD=../hw5/mm_preload.so ../hw2/pwords ../hw2/gutenberg/alice.txt
+ *
+ * mm_malloc already returns zero-filled memory, so calloc only has to check
+ * for overflow.
+ *
+ * If MM_TRACE names a file, every malloc/realloc/free is also appended to
+ * it in the trace format that mm_bench replays.
+ */
+
+#include "mm_alloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static int traceFd = -1;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((constructor))
+static void openTrace(void) {
+    const char *path = getenv("MM_TRACE");
+    if (path != NULL) {
+        traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    }
+}
+
+// Formats by hand: stdio may allocate, which would recurse into malloc
+static char *appendNumber(char *out, uint64_t value, int base) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    *out++ = ' ';
+    while (n > 0) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+static void traceCall(char kind, void *ptr, void *newPtr, size_t size) {
+    char line[80];
+    char *out = line;
+
+    *out++ = kind;
+    out = appendNumber(out, (uintptr_t) ptr, 16);
+    if (kind == 'r') {
+        out = appendNumber(out, (uintptr_t) newPtr, 16);
+    }
+    if (kind != 'f') {
+        out = appendNumber(out, size, 10);
+    }
+    *out++ = '\n';
+
+    pthread_mutex_lock(&traceLock);
+    write(traceFd, line, out - line);
+    pthread_mutex_unlock(&traceLock);
+}
+
+void *malloc(size_t size) {
+    void *ptr = mm_malloc(size);
+    if (ptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    if (traceFd >= 0 && ptr != NULL) {
+        traceCall('m', ptr, NULL, size);
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (traceFd >= 0 && ptr != NULL) {
+        traceCall('f', ptr, NULL, 0);
+    }
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return malloc(nmemb * size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *newPtr = mm_realloc(ptr, size);
+    if (traceFd >= 0 && (newPtr != NULL || size == 0)) {
+        traceCall('r', ptr, newPtr, size);
+    }
+    return newPtr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = mm_memalign(alignment, size);
+    if (ptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    if (traceFd >= 0 && ptr != NULL) {
+        traceCall('m', ptr, NULL, size);
+    }
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = mm_memalign(alignment, size);
+    if (ptr == NULL && size != 0) {
+        return ENOMEM;
+    }
+    if (traceFd >= 0 && ptr != NULL) {
+        traceCall('m', ptr, NULL, size);
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
@@ -0,0 +1,438 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Buffer cache.
+
+   All file system I/O goes through a cache of CACHE_SIZE
+   sectors of the file system device.  Writes only change the
+   cached copy and mark it dirty; dirty sectors reach the disk
+   when they are evicted, every FLUSH_INTERVAL ticks when the
+   flush thread wakes up, and at file system shutdown.
+
+   cache_lock protects the mapping from sectors to entries, the
+   entries' pin counts and accessed bits, and the clock hand.
+   Each entry also has its own lock, which protects its data, so
+   that different sectors can be read and written at the same
+   time.  A thread pins an entry under cache_lock before it takes
+   the entry's lock and unpins it after releasing that lock, and
+   only unpinned entries are evicted, so an entry cannot be
+   reassigned to another sector while it is in use.
+
+   The victim for eviction is chosen by the clock algorithm.  It
+   is pinned and bound to its new sector at once, under
+   cache_lock, so that no other entry can be made for that
+   sector, and a thread that wants the new sector pins it and
+   waits on its lock.  A dirty victim's old sector is recorded
+   in old_sector while the evicting thread writes it back under
+   the entry's lock with cache_lock released, so that lookups of
+   other sectors do not wait for the disk.  A thread that wants
+   the old sector in the meantime waits for the write to finish
+   instead of reading stale data from disk.
+
+   cache_read_ahead() queues a sector that will probably be read
+   soon, and returns at once.  The read-ahead thread reads queued
+   sectors into the cache in the background, so that a thread
+   reading a file sequentially finds the next sectors already
+   there.  The queue is small and requests that do not fit are
+   dropped: read-ahead is only a hint. */
+
+/* Number of sectors in the cache. */
+#define CACHE_SIZE 64
+
+/* Ticks between writes of dirty sectors by the flush thread. */
+#define FLUSH_INTERVAL (5 * TIMER_FREQ)
+
+/* Most sectors waiting to be read ahead. */
+#define READ_AHEAD_MAX 16
+
+/* Sector number of an unused entry. */
+#define NO_SECTOR ((block_sector_t) -1)
+
+/* A cached sector. */
+struct cache_entry
+  {
+    /* Protected by cache_lock. */
+    block_sector_t sector;              /* Sector cached, or NO_SECTOR. */
+    int pin_cnt;                        /* Threads using this entry. */
+    bool accessed;                      /* Used since the clock hand passed? */
+    block_sector_t old_sector;          /* Sector being written back, or
+                                           NO_SECTOR. */
+
+    /* Protected by LOCK. */
+    struct lock lock;                   /* Protects the members below. */
+    bool valid;                         /* Has DATA been read in? */
+    bool dirty;                         /* Does DATA differ from disk? */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Sector contents. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;
+static struct condition cache_unpinned; /* Signaled when an entry is
+                                           unpinned. */
+static struct condition cache_written_back; /* Broadcast when an evicted
+                                               sector reaches disk. */
+static size_t clock_hand;               /* Next entry to consider. */
+
+/* Sectors to read ahead, a circular queue protected by
+   cache_lock. */
+static block_sector_t read_ahead_queue[READ_AHEAD_MAX];
+static size_t read_ahead_head;          /* Index of oldest request. */
+static size_t read_ahead_cnt;           /* Number of requests. */
+static struct condition read_ahead_ready; /* Signaled on a new request. */
+
+/* Statistics, protected by cache_lock. */
+static unsigned long long hit_cnt;      /* Lookups that found the sector. */
+static unsigned long long miss_cnt;     /* Lookups that had to evict. */
+static unsigned long long writeback_cnt; /* Dirty sectors written. */
+static unsigned long long read_ahead_total; /* Sectors read ahead. */
+
+static thread_func flush_daemon NO_RETURN;
+static thread_func read_ahead_daemon NO_RETURN;
+
+/* Initializes the buffer cache and starts its flush and
+   read-ahead threads. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  lock_init (&cache_lock);
+  cond_init (&cache_unpinned);
+  cond_init (&cache_written_back);
+  cond_init (&read_ahead_ready);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->sector = NO_SECTOR;
+      e->pin_cnt = 0;
+      e->accessed = false;
+      e->old_sector = NO_SECTOR;
+      lock_init (&e->lock);
+      e->valid = false;
+      e->dirty = false;
+    }
+
+  thread_create ("cache-flush", PRI_DEFAULT, flush_daemon, NULL);
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+}
+
+/* Returns the entry that caches SECTOR, or a null pointer if
+   there is none.  cache_lock must be held. */
+static struct cache_entry *
+lookup (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Returns true if SECTOR is being written back by an eviction.
+   cache_lock must be held. */
+static bool
+writing_back (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].old_sector == sector)
+      return true;
+  return false;
+}
+
+/* Chooses an unpinned entry to reuse by the clock algorithm and
+   returns it, or returns a null pointer if every entry is
+   pinned.  cache_lock must be held. */
+static struct cache_entry *
+choose_victim (void)
+{
+  size_t i;
+
+  /* Two sweeps clear every accessed bit along the way, so only
+     finding everything pinned ends the loop empty. */
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *c = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+      if (c->pin_cnt > 0)
+        continue;
+      if (c->accessed)
+        c->accessed = false;
+      else
+        return c;
+    }
+  return NULL;
+}
+
+/* Rebinds E, which was just pinned, to SECTOR, writing back its
+   old sector first if it is dirty.  cache_lock must be held; it
+   is released during the write. */
+static void
+evict (struct cache_entry *e, block_sector_t sector)
+{
+  block_sector_t old_sector = e->sector;
+
+  /* No thread holds the lock of an entry that was unpinned, so
+     this does not wait, and anyone who pins E for SECTOR from
+     now on waits for us on E's lock. */
+  lock_acquire (&e->lock);
+  e->sector = sector;
+  if (e->dirty)
+    {
+      e->old_sector = old_sector;
+      lock_release (&cache_lock);
+
+      block_write (fs_device, old_sector, e->data);
+      e->dirty = false;
+      e->valid = false;
+      lock_release (&e->lock);
+
+      lock_acquire (&cache_lock);
+      e->old_sector = NO_SECTOR;
+      writeback_cnt++;
+      cond_broadcast (&cache_written_back, &cache_lock);
+    }
+  else
+    {
+      e->valid = false;
+      lock_release (&e->lock);
+    }
+}
+
+/* Pins and returns the entry for SECTOR, evicting another sector
+   to make room if it is not cached.  cache_lock must be held,
+   but may be released and reacquired while waiting for an entry
+   or for a write-back.  Stores in *HIT whether SECTOR was
+   already cached. */
+static struct cache_entry *
+pin (block_sector_t sector, bool *hit)
+{
+  struct cache_entry *e;
+
+  for (;;)
+    {
+      e = lookup (sector);
+      if (e != NULL)
+        {
+          *hit = true;
+          break;
+        }
+
+      /* An entry that is writing SECTOR back no longer holds it,
+         but the disk does not either until the write is done. */
+      if (writing_back (sector))
+        cond_wait (&cache_written_back, &cache_lock);
+      else
+        {
+          e = choose_victim ();
+          if (e != NULL)
+            {
+              *hit = false;
+              break;
+            }
+          cond_wait (&cache_unpinned, &cache_lock);
+        }
+    }
+
+  e->pin_cnt++;
+  e->accessed = true;
+  if (!*hit)
+    evict (e, sector);
+  return e;
+}
+
+/* Locks pinned entry E and makes sure it holds its sector's
+   data, reading it in unless OVERWRITE is true, in which case
+   the caller is about to replace all of it. */
+static void
+lock_entry (struct cache_entry *e, bool overwrite)
+{
+  lock_acquire (&e->lock);
+  if (!e->valid)
+    {
+      if (!overwrite)
+        block_read (fs_device, e->sector, e->data);
+      e->valid = true;
+    }
+}
+
+/* Returns the entry for SECTOR, locked, with its data read in
+   unless OVERWRITE is true.  Must be released with
+   cache_put(). */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool overwrite)
+{
+  struct cache_entry *e;
+  bool hit;
+
+  lock_acquire (&cache_lock);
+  e = pin (sector, &hit);
+  if (hit)
+    hit_cnt++;
+  else
+    miss_cnt++;
+  lock_release (&cache_lock);
+
+  lock_entry (e, overwrite);
+  return e;
+}
+
+/* Releases entry E, obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+
+  lock_acquire (&cache_lock);
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Reads SIZE bytes starting at byte OFS of SECTOR into BUFFER. */
+void
+cache_read (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, false);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR, starting at byte
+   OFS.  The write reaches the disk later. */
+void
+cache_write (block_sector_t sector, const void *buffer, size_t ofs,
+             size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, ofs == 0 && size == BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Asks for SECTOR to be read into the cache in the background,
+   unless it is already cached or queued. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&cache_lock);
+  if (read_ahead_cnt < READ_AHEAD_MAX && lookup (sector) == NULL)
+    {
+      size_t i;
+
+      for (i = 0; i < read_ahead_cnt; i++)
+        if (read_ahead_queue[(read_ahead_head + i) % READ_AHEAD_MAX]
+            == sector)
+          break;
+      if (i == read_ahead_cnt)
+        {
+          read_ahead_queue[(read_ahead_head + read_ahead_cnt++)
+                           % READ_AHEAD_MAX] = sector;
+          cond_signal (&read_ahead_ready, &cache_lock);
+        }
+    }
+  lock_release (&cache_lock);
+}
+
+/* Writes every dirty sector to disk. */
+void
+cache_flush (void)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+
+      /* Pin the entry so that it keeps its sector while we wait
+         for its lock. */
+      lock_acquire (&cache_lock);
+      if (e->sector == NO_SECTOR)
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      if (e->dirty)
+        {
+          block_write (fs_device, e->sector, e->data);
+          e->dirty = false;
+          lock_acquire (&cache_lock);
+          writeback_cnt++;
+          lock_release (&cache_lock);
+        }
+      cache_put (e);
+    }
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  unsigned long long lookups = hit_cnt + miss_cnt;
+  unsigned long long permille = lookups > 0 ? hit_cnt * 1000 / lookups : 0;
+
+  printf ("Cache: %llu hits, %llu misses (%llu.%llu%% hit rate), "
+          "%llu write-backs, %llu read ahead\n",
+          hit_cnt, miss_cnt, permille / 10, permille % 10, writeback_cnt,
+          read_ahead_total);
+}
+
+/* Writes dirty sectors back every FLUSH_INTERVAL ticks, so that a
+   crash loses only recent writes. */
+static void
+flush_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (FLUSH_INTERVAL);
+      cache_flush ();
+    }
+}
+
+/* Reads queued sectors into the cache, one at a time, as
+   requested by cache_read_ahead(). */
+static void
+read_ahead_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct cache_entry *e;
+      block_sector_t sector;
+      bool hit;
+
+      lock_acquire (&cache_lock);
+      while (read_ahead_cnt == 0)
+        cond_wait (&read_ahead_ready, &cache_lock);
+      sector = read_ahead_queue[read_ahead_head];
+      read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_MAX;
+      read_ahead_cnt--;
+
+      e = pin (sector, &hit);
+      if (!hit)
+        read_ahead_total++;
+      lock_release (&cache_lock);
+
+      lock_entry (e, false);
+      cache_put (e);
+    }
+}
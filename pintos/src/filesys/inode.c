@@ -3,21 +3,45 @@
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of direct sector pointers in an inode. */
+#define DIRECT_CNT 123
+
+/* Number of sector pointers in an indirect block. */
+#define PTRS_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+
+/* Number of data sectors a file can have: a little over 8 MB. */
+#define MAX_SECTORS (DIRECT_CNT + PTRS_PER_SECTOR \
+                     + PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   A file's data sectors are found through an index: the first
+   DIRECT_CNT are listed in the inode itself, the next
+   PTRS_PER_SECTOR in an indirect block, and the rest through a
+   doubly indirect block, which lists indirect blocks.  Sector 0
+   holds the free map's inode, so it can never be a data or index
+   sector, and a pointer of 0 means that the sector does not
+   exist yet.  Reading such a hole gives zeros; writing it
+   allocates the sector. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
+    block_sector_t direct[DIRECT_CNT];  /* Direct data sectors. */
+    block_sector_t indirect;            /* Indirect block. */
+    block_sector_t doubly_indirect;     /* Doubly indirect block. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t unused[1];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -36,37 +60,188 @@ struct inode
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct rwlock rwlock;               /* For users of its contents. */
+    struct lock grow_lock;              /* Serializes sector allocation
+                                           and growth. */
     struct inode_disk data;             /* Inode content. */
   };
 
+/* Allocates a sector and fills it with zeros.  Returns the
+   sector, or 0 if the disk is full. */
+static block_sector_t
+allocate_zeroed (void)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector;
+
+  if (!free_map_allocate (1, &sector))
+    return 0;
+  cache_write (sector, zeros, 0, BLOCK_SECTOR_SIZE);
+  return sector;
+}
+
+/* Returns entry IDX of index block INDEX.  If the entry is 0 and
+   CREATE is true, first points it to a newly allocated sector. */
+static block_sector_t
+index_entry (block_sector_t index, size_t idx, bool create)
+{
+  block_sector_t sector;
+
+  cache_read (index, &sector, idx * sizeof sector, sizeof sector);
+  if (sector == 0 && create)
+    {
+      sector = allocate_zeroed ();
+      if (sector != 0)
+        cache_write (index, &sector, idx * sizeof sector, sizeof sector);
+    }
+  return sector;
+}
+
+/* Returns *SLOT, a pointer in DISK, the on-disk inode stored in
+   sector INODE_SECTOR.  If *SLOT is 0 and CREATE is true, first
+   points it to a newly allocated sector and writes DISK back. */
+static block_sector_t
+inode_entry (struct inode_disk *disk, block_sector_t inode_sector,
+             block_sector_t *slot, bool create)
+{
+  if (*slot == 0 && create)
+    {
+      *slot = allocate_zeroed ();
+      if (*slot != 0)
+        cache_write (inode_sector, disk, 0, BLOCK_SECTOR_SIZE);
+    }
+  return *slot;
+}
+
+/* Returns the sector that holds data sector IDX of DISK, the
+   on-disk inode stored in sector INODE_SECTOR, or 0 if it has
+   not been allocated.  If CREATE is true, allocates it, and any
+   index blocks on the way to it, if they do not exist; then 0
+   means the disk is full or IDX is too big. */
+static block_sector_t
+lookup_sector (struct inode_disk *disk, block_sector_t inode_sector,
+               size_t idx, bool create)
+{
+  block_sector_t index;
+
+  if (idx < DIRECT_CNT)
+    return inode_entry (disk, inode_sector, &disk->direct[idx], create);
+  idx -= DIRECT_CNT;
+
+  if (idx < PTRS_PER_SECTOR)
+    {
+      index = inode_entry (disk, inode_sector, &disk->indirect, create);
+      return index != 0 ? index_entry (index, idx, create) : 0;
+    }
+  idx -= PTRS_PER_SECTOR;
+
+  if (idx < PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+    {
+      index = inode_entry (disk, inode_sector, &disk->doubly_indirect,
+                           create);
+      if (index != 0)
+        index = index_entry (index, idx / PTRS_PER_SECTOR, create);
+      return index != 0 ? index_entry (index, idx % PTRS_PER_SECTOR,
+                                       create) : 0;
+    }
+  return 0;
+}
+
+/* Frees SECTOR and, if LEVEL is greater than 0, the sectors it
+   lists as an index block of that many levels.  Does nothing if
+   SECTOR is 0. */
+static void
+release_tree (block_sector_t sector, int level)
+{
+  if (sector == 0)
+    return;
+  if (level > 0)
+    {
+      size_t i;
+
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        release_tree (index_entry (sector, i, false), level - 1);
+    }
+  free_map_release (sector, 1);
+}
+
+/* Frees all of the data and index sectors of DISK. */
+static void
+release_sectors (const struct inode_disk *disk)
+{
+  size_t i;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    release_tree (disk->direct[i], 0);
+  release_tree (disk->indirect, 1);
+  release_tree (disk->doubly_indirect, 2);
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   within INODE, or 0 if that part of INODE is a hole. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos)
+byte_to_sector (struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
-    return -1;
+  return lookup_sector (&inode->data, inode->sector,
+                        pos / BLOCK_SECTOR_SIZE, false);
 }
 
 /* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
+   returns the same `struct inode'.  Searching it only needs
+   open_inodes_lock for reading, so lookups proceed in parallel;
+   adding or removing an inode needs it for writing.  Open counts
+   can change under a read lock, so they are updated under
+   open_cnt_lock. */
 static struct list open_inodes;
+static struct rwlock open_inodes_lock;
+static struct spinlock open_cnt_lock;
+
+/* Cache of struct inode.  An inode's locks are free whenever the
+   inode is, so they are initialized once, by the constructor. */
+static struct kmem_cache inode_cache;
+
+static void
+inode_ctor (void *inode_)
+{
+  struct inode *inode = inode_;
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->grow_lock);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
   list_init (&open_inodes);
+  rwlock_init (&open_inodes_lock);
+  spin_init (&open_cnt_lock);
+  kmem_cache_init (&inode_cache, "inode", sizeof (struct inode), inode_ctor);
+}
+
+/* Returns the open inode for SECTOR, or a null pointer if it is
+   not open.  open_inodes_lock must be held. */
+static struct inode *
+find_open_inode (block_sector_t sector)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+       e = list_next (e))
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+      if (inode->sector == sector)
+        return inode;
+    }
+  return NULL;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data sectors are allocated (and zeroed) now, so
+   that writes within LENGTH never need to allocate; this matters
+   for the free map file, which cannot allocate sectors for
+   itself.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
@@ -85,21 +260,17 @@ inode_create (block_sector_t sector, off_t length)
   if (disk_inode != NULL)
     {
       size_t sectors = bytes_to_sectors (length);
+      size_t i;
+
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start))
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0)
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-
-              for (i = 0; i < sectors; i++)
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true;
-        }
+      success = sectors <= MAX_SECTORS;
+      for (i = 0; success && i < sectors; i++)
+        success = lookup_sector (disk_inode, sector, i, true) != 0;
+      if (success)
+        cache_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+      else
+        release_sectors (disk_inode);
       free (disk_inode);
     }
   return success;
@@ -111,33 +282,41 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
+  struct inode *existing;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          return inode;
-        }
-    }
+  rwlock_acquire_read (&open_inodes_lock);
+  inode = inode_reopen (find_open_inode (sector));
+  rwlock_release_read (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
-  inode = malloc (sizeof *inode);
+  inode = kmem_cache_alloc (&inode_cache);
   if (inode == NULL)
     return NULL;
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  cache_read (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+
+  /* Another thread may have opened the same inode while we were
+     reading it, in which case we use that one instead. */
+  rwlock_acquire_write (&open_inodes_lock);
+  existing = inode_reopen (find_open_inode (sector));
+  if (existing == NULL)
+    list_push_front (&open_inodes, &inode->elem);
+  rwlock_release_write (&open_inodes_lock);
+
+  if (existing != NULL)
+    {
+      kmem_cache_free (&inode_cache, inode);
+      inode = existing;
+    }
   return inode;
 }
 
@@ -146,7 +325,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      spin_lock (&open_cnt_lock);
+      inode->open_cnt++;
+      spin_unlock (&open_cnt_lock);
+    }
   return inode;
 }
 
@@ -163,25 +346,31 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode)
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  rwlock_acquire_write (&open_inodes_lock);
+  spin_lock (&open_cnt_lock);
+  last = --inode->open_cnt == 0;
+  spin_unlock (&open_cnt_lock);
+  if (last)
+    list_remove (&inode->elem);
+  rwlock_release_write (&open_inodes_lock);
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
-
       /* Deallocate blocks if removed. */
       if (inode->removed)
         {
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length));
+          release_sectors (&inode->data);
         }
 
-      free (inode);
+      kmem_cache_free (&inode_cache, inode);
     }
 }
 
@@ -202,7 +391,6 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
   while (size > 0)
     {
@@ -220,47 +408,47 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
+      if (sector_idx != 0)
+        cache_read (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       else
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+        memset (buffer + bytes_read, 0, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
   return bytes_read;
 }
 
+/* Asks for up to SECTOR_CNT sectors of INODE's data, starting
+   with the one that holds byte OFFSET, to be read into the
+   buffer cache in the background. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, size_t sector_cnt)
+{
+  offset -= offset % BLOCK_SECTOR_SIZE;
+  for (; sector_cnt > 0 && offset < inode_length (inode); sector_cnt--)
+    {
+      block_sector_t sector = byte_to_sector (inode, offset);
+      if (sector != 0)
+        cache_read_ahead (sector);
+      offset += BLOCK_SECTOR_SIZE;
+    }
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or the file reaches its
+   maximum size.  Writing past end of file extends the file;
+   any part of the file skipped over is left as a hole. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
 
   if (inode->deny_write_cnt)
     return 0;
@@ -268,51 +456,45 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
+      size_t idx = offset / BLOCK_SECTOR_SIZE;
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in sector, and bytes to write into it. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
-
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
+      int chunk_size = size < sector_left ? size : sector_left;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      /* Allocate the sector if it does not exist yet. */
+      if (sector_idx == 0)
         {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
+          lock_acquire (&inode->grow_lock);
+          sector_idx = lookup_sector (&inode->data, inode->sector, idx, true);
+          lock_release (&inode->grow_lock);
+          if (sector_idx == 0)
+            break;
         }
-      else
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
 
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left)
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+                   chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
+
+      /* Extend the file to cover what we wrote. */
+      if (offset > inode_length (inode))
+        {
+          lock_acquire (&inode->grow_lock);
+          if (offset > inode->data.length)
+            {
+              inode->data.length = offset;
+              cache_write (inode->sector, &inode->data, 0,
+                           BLOCK_SECTOR_SIZE);
+            }
+          lock_release (&inode->grow_lock);
+        }
     }
-  free (bounce);
 
   return bytes_written;
 }
@@ -343,3 +525,34 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Locks INODE's contents for reading, alongside other readers.
+   The inode module itself does not take this lock; it is for
+   code, such as directories, that needs a consistent view of
+   what is stored in the inode. */
+void
+inode_lock_read (struct inode *inode)
+{
+  rwlock_acquire_read (&inode->rwlock);
+}
+
+/* Releases a read lock taken by inode_lock_read(). */
+void
+inode_unlock_read (struct inode *inode)
+{
+  rwlock_release_read (&inode->rwlock);
+}
+
+/* Locks INODE's contents for writing, excluding all readers. */
+void
+inode_lock_write (struct inode *inode)
+{
+  rwlock_acquire_write (&inode->rwlock);
+}
+
+/* Releases a write lock taken by inode_lock_write(). */
+void
+inode_unlock_write (struct inode *inode)
+{
+  rwlock_release_write (&inode->rwlock);
+}
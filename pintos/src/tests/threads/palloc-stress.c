@@ -0,0 +1,185 @@
+/* Fills the user pool one page at a time, then frees every other
+   page so that no two free pages are buddies, and checks that the
+   allocator does not hand out a two-page run in that state.  The
+   cost of a single-page allocation from the empty and from the
+   fragmented pool is printed for comparison, but not checked,
+   since it depends on the machine and the emulator.  Then frees
+   everything and checks that the pages coalesce back into runs
+   that can be allocated whole, that every page is still there,
+   and that PAL_ZERO still zeros.
+   Last, fills the pool again, frees exactly 37 pages that do not
+   start on a 64-page boundary, and checks that those 37 pages
+   can be allocated back as one run. */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Number of allocations timed in each state. */
+#define ITER_CNT 1000
+
+/* Each page we hold stores a pointer to the next one. */
+struct held_page
+  {
+    struct held_page *next;
+  };
+
+static inline uint64_t
+read_tsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Allocates every free user page onto a list, returning the list
+   and storing the number of pages in *CNT. */
+static struct held_page *
+take_all (size_t *cnt)
+{
+  struct held_page *list = NULL;
+  struct held_page *p;
+
+  *cnt = 0;
+  while ((p = palloc_get_page (PAL_USER)) != NULL)
+    {
+      p->next = list;
+      list = p;
+      ++*cnt;
+    }
+  return list;
+}
+
+/* Frees the pages on LIST for which KEEP is false, and returns
+   the list of the others. */
+static struct held_page *
+release (struct held_page *list, bool (*keep) (const struct held_page *))
+{
+  struct held_page *kept = NULL;
+
+  while (list != NULL)
+    {
+      struct held_page *p = list;
+      list = p->next;
+      if (keep != NULL && keep (p))
+        {
+          p->next = kept;
+          kept = p;
+        }
+      else
+        palloc_free_page (p);
+    }
+  return kept;
+}
+
+static bool
+odd_page (const struct held_page *p)
+{
+  return pg_no (p) % 2 != 0;
+}
+
+/* Pages [span_start, span_end) are freed by outside_span(). */
+static const struct held_page *span_start, *span_end;
+
+static bool
+outside_span (const struct held_page *p)
+{
+  return p < span_start || p >= span_end;
+}
+
+/* Returns the lowest-addressed page on LIST. */
+static struct held_page *
+lowest_page (struct held_page *list)
+{
+  struct held_page *low = list;
+
+  for (; list != NULL; list = list->next)
+    if (list < low)
+      low = list;
+  return low;
+}
+
+/* Returns the average cycles taken to allocate and free a single
+   user page. */
+static uint64_t
+time_get_page (void)
+{
+  uint64_t start = read_tsc ();
+  int i;
+
+  for (i = 0; i < ITER_CNT; i++)
+    {
+      void *page = palloc_get_page (PAL_USER);
+      if (page == NULL)
+        fail ("palloc_get_page failed with free pages left");
+      palloc_free_page (page);
+    }
+  return (read_tsc () - start) / ITER_CNT;
+}
+
+void
+test_palloc_stress (void)
+{
+  struct held_page *held, *base;
+  size_t page_cnt, cnt, i;
+  uint64_t empty_cycles, fragmented_cycles;
+  uint8_t *run;
+
+  held = take_all (&page_cnt);
+  if (page_cnt < 64)
+    fail ("only %zu pages in the user pool", page_cnt);
+  release (held, NULL);
+  empty_cycles = time_get_page ();
+
+  /* Hold the odd pages only.  Each buddy pair now has one page
+     free and one held, so there is no free run of two pages. */
+  held = release (take_all (&cnt), odd_page);
+  if (cnt != page_cnt)
+    fail ("pool had %zu pages, then %zu", page_cnt, cnt);
+  if (palloc_get_multiple (PAL_USER, 2) != NULL)
+    fail ("allocated two contiguous pages from a fragmented pool");
+  fragmented_cycles = time_get_page ();
+
+  msg ("allocating a page: %"PRIu64" cycles with the pool empty, "
+       "%"PRIu64" with it fragmented", empty_cycles, fragmented_cycles);
+
+  /* Give everything back; it must merge into large runs again. */
+  release (held, NULL);
+  run = palloc_get_multiple (PAL_USER | PAL_ZERO, 37);
+  if (run == NULL)
+    fail ("could not allocate 37 pages after freeing all pages");
+  for (i = 0; i < 37 * PGSIZE; i++)
+    if (run[i] != 0)
+      fail ("byte %zu of PAL_ZERO run is %d", i, run[i]);
+  palloc_free_multiple (run, 37);
+  release (take_all (&cnt), NULL);
+  if (cnt != page_cnt)
+    fail ("pool had %zu pages after coalescing, then %zu",
+          page_cnt, cnt);
+
+  /* Free pages 3 through 39 of the pool only.  They span several
+     buddy blocks of different sizes, none of them 64 pages, so
+     the 37-page run must be put together from adjacent blocks. */
+  held = take_all (&cnt);
+  if (cnt != page_cnt)
+    fail ("pool had %zu pages, then %zu", page_cnt, cnt);
+  base = lowest_page (held);
+  span_start = (struct held_page *) ((uint8_t *) base + 3 * PGSIZE);
+  span_end = (struct held_page *) ((uint8_t *) base + 40 * PGSIZE);
+  held = release (held, outside_span);
+  run = palloc_get_multiple (PAL_USER, 37);
+  if (run != (uint8_t *) span_start)
+    fail ("allocated 37 pages at %p instead of the free span at %p",
+          run, span_start);
+  palloc_free_multiple (run, 37);
+  release (held, NULL);
+
+  release (take_all (&cnt), NULL);
+  if (cnt != page_cnt)
+    fail ("pool had %zu pages, then %zu", page_cnt, cnt);
+
+  pass ();
+}
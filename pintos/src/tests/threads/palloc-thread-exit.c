@@ -0,0 +1,116 @@
+/* Creates and exits many threads while another thread keeps
+   allocating and freeing kernel pages.  The page of each dying
+   thread is freed by the scheduler, with interrupts off, as it
+   switches to the next thread, and that must work even when the
+   timer has preempted the allocating thread in the middle of a
+   palloc call.  Finally checks that every kernel page that was
+   free at the start is free again. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+
+/* Number of threads created and exited. */
+#define THREAD_CNT 1000
+
+static thread_func alloc_thread, exit_thread;
+static size_t count_free_pages (void);
+
+/* Set by the main thread to stop alloc_thread(). */
+static volatile bool done;
+
+/* Number of pages allocated by alloc_thread(). */
+static volatile unsigned alloc_cnt;
+
+void
+test_palloc_thread_exit (void)
+{
+  size_t free_before, free_after;
+  int i;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  free_before = count_free_pages ();
+
+  thread_create ("alloc", PRI_DEFAULT, alloc_thread, NULL);
+  for (i = 0; i < THREAD_CNT; i++)
+    {
+      char name[16];
+
+      snprintf (name, sizeof name, "exit %d", i);
+      if (thread_create (name, PRI_DEFAULT, exit_thread, NULL)
+          == TID_ERROR)
+        fail ("could not create thread %d", i);
+
+      /* Let it run and exit, so that only a few dying threads
+         are around at a time. */
+      thread_yield ();
+    }
+
+  /* Stop the allocating thread, and let it and any thread not
+     yet gone exit before we look at the pool again. */
+  done = true;
+  thread_set_priority (PRI_MIN);
+  thread_set_priority (PRI_DEFAULT);
+
+  if (alloc_cnt == 0)
+    fail ("the allocating thread never ran");
+  free_after = count_free_pages ();
+  if (free_after != free_before)
+    fail ("%zu free kernel pages before, %zu after",
+          free_before, free_after);
+
+  pass ();
+}
+
+/* Allocates and frees kernel pages until told to stop. */
+static void
+alloc_thread (void *aux UNUSED)
+{
+  while (!done)
+    {
+      void *page = palloc_get_page (0);
+      if (page == NULL)
+        fail ("out of kernel pages");
+      palloc_free_page (page);
+      alloc_cnt++;
+    }
+}
+
+static void
+exit_thread (void *aux UNUSED)
+{
+}
+
+/* Each page counted stores a pointer to the next one. */
+struct counted_page
+  {
+    struct counted_page *next;
+  };
+
+/* Returns the number of free kernel pages, by allocating all of
+   them and then freeing them again. */
+static size_t
+count_free_pages (void)
+{
+  struct counted_page *list = NULL;
+  struct counted_page *p;
+  size_t cnt = 0;
+
+  while ((p = palloc_get_page (0)) != NULL)
+    {
+      p->next = list;
+      list = p;
+      cnt++;
+    }
+  while (list != NULL)
+    {
+      p = list;
+      list = p->next;
+      palloc_free_page (p);
+    }
+  return cnt;
+}
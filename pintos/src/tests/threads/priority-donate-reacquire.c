@@ -0,0 +1,58 @@
+/* The main thread acquires a lock, and a higher-priority thread
+   blocks acquiring it, donating its priority.  The main thread
+   then raises its own priority above the donor's, releases the
+   lock and at once acquires it again, before the woken donor
+   gets to run.  When the main thread lowers its priority back
+   to the default, the donor runs, finds the lock taken again,
+   and must donate its priority once more, so that the main
+   thread keeps running at the donor's priority until it
+   releases the lock for good. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+static thread_func acquire_thread_func;
+
+void
+test_priority_donate_reacquire (void)
+{
+  struct lock lock;
+
+  /* This test does not work with the MLFQS. */
+  ASSERT (!thread_mlfqs);
+
+  /* Make sure our priority is the default. */
+  ASSERT (thread_get_priority () == PRI_DEFAULT);
+
+  lock_init (&lock);
+  lock_acquire (&lock);
+  thread_create ("acquire", PRI_DEFAULT + 2, acquire_thread_func, &lock);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT + 2, thread_get_priority ());
+
+  thread_set_priority (PRI_DEFAULT + 5);
+  lock_release (&lock);
+  lock_acquire (&lock);
+  msg ("Main thread re-acquired the lock ahead of acquire.");
+
+  thread_set_priority (PRI_DEFAULT);
+  msg ("This thread should have priority %d.  Actual priority: %d.",
+       PRI_DEFAULT + 2, thread_get_priority ());
+  lock_release (&lock);
+  msg ("acquire must already have finished.");
+  msg ("This should be the last line before finishing this test.");
+}
+
+static void
+acquire_thread_func (void *lock_)
+{
+  struct lock *lock = lock_;
+
+  lock_acquire (lock);
+  msg ("acquire: got the lock");
+  lock_release (lock);
+  msg ("acquire: done");
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(priority-donate-reacquire) begin
+(priority-donate-reacquire) This thread should have priority 33.  Actual priority: 33.
+(priority-donate-reacquire) Main thread re-acquired the lock ahead of acquire.
+(priority-donate-reacquire) This thread should have priority 33.  Actual priority: 33.
+(priority-donate-reacquire) acquire: got the lock
+(priority-donate-reacquire) acquire: done
+(priority-donate-reacquire) acquire must already have finished.
+(priority-donate-reacquire) This should be the last line before finishing this test.
+(priority-donate-reacquire) end
+EOF
+pass;
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -32,7 +33,22 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   In front of each descriptor there is a "magazine" of free
+   blocks, so that most calls to malloc() and free() never touch
+   the descriptor: they just take a block from, or put one into,
+   the magazine, with interrupts disabled for those few
+   instructions instead of acquiring the descriptor's lock.
+   Pintos runs on a single CPU, so one set of magazines, shared
+   by every thread, plays the part of a per-CPU set.  (Keeping
+   them in struct thread would take space from the kernel
+   stack, which shares the thread's page.)  Only when the
+   magazine is empty does malloc() take the lock, and then it
+   moves a batch of blocks into the magazine at once; likewise,
+   freeing into a full magazine moves half of it back to the
+   free list in one go.  As far as an arena is concerned, blocks
+   in a magazine are in use. */
 
 /* Descriptor. */
 struct desc
@@ -60,12 +76,31 @@ struct block
     struct list_elem free_elem; /* Free list element. */
   };
 
+/* Cache of free blocks of one size class. */
+#define MAGAZINE_ROUNDS 8       /* Blocks per magazine. */
+struct magazine
+  {
+    size_t cnt;                         /* Number of blocks in ROUNDS. */
+    void *rounds[MAGAZINE_ROUNDS];      /* Cached free blocks. */
+  };
+
 /* Our set of descriptors. */
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* One magazine per descriptor.  Accessed only with interrupts
+   disabled. */
+static struct magazine magazines[sizeof descs / sizeof *descs];
+
+/* Blocks moved into a magazine when it runs dry, including the
+   one returned to the caller. */
+#define REFILL_CNT (MAGAZINE_ROUNDS / 2 + 1)
+
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static bool new_arena (struct desc *);
+static void *refill_magazine (struct desc *, struct magazine *);
+static void release_blocks (struct desc *, void **blocks, size_t cnt);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -90,8 +125,9 @@ void *
 malloc (size_t size)
 {
   struct desc *d;
-  struct block *b;
+  struct magazine *m;
   struct arena *a;
+  enum intr_level old_level;
 
   /* A null pointer satisfies a request for 0 bytes. */
   if (size == 0)
@@ -119,38 +155,90 @@ malloc (size_t size)
       return a + 1;
     }
 
-  lock_acquire (&d->lock);
+  /* Take a block from the magazine, if it has one. */
+  m = &magazines[d - descs];
+  old_level = intr_disable ();
+  if (m->cnt > 0)
+    {
+      void *b = m->rounds[--m->cnt];
+      intr_set_level (old_level);
+      return b;
+    }
+  intr_set_level (old_level);
+
+  return refill_magazine (d, m);
+}
 
-  /* If the free list is empty, create a new arena. */
-  if (list_empty (&d->free_list))
+/* Moves up to REFILL_CNT blocks from D's free list, creating an
+   arena if there are none, and returns one of them after putting
+   the rest in magazine M.  Returns a null pointer if memory is
+   not available. */
+static void *
+refill_magazine (struct desc *d, struct magazine *m)
+{
+  void *batch[REFILL_CNT];
+  size_t cnt = 0;
+  enum intr_level old_level;
+
+  lock_acquire (&d->lock);
+  while (cnt < REFILL_CNT)
     {
-      size_t i;
+      struct block *b;
 
-      /* Allocate a page. */
-      a = palloc_get_page (0);
-      if (a == NULL)
-        {
-          lock_release (&d->lock);
-          return NULL;
-        }
+      /* Only start a new arena if we have nothing yet. */
+      if (list_empty (&d->free_list) && (cnt > 0 || !new_arena (d)))
+        break;
 
-      /* Initialize arena and add its blocks to the free list. */
-      a->magic = ARENA_MAGIC;
-      a->desc = d;
-      a->free_cnt = d->blocks_per_arena;
-      for (i = 0; i < d->blocks_per_arena; i++)
-        {
-          struct block *b = arena_to_block (a, i);
-          list_push_back (&d->free_list, &b->free_elem);
-        }
+      b = list_entry (list_pop_front (&d->free_list), struct block,
+                      free_elem);
+      block_to_arena (b)->free_cnt--;
+      batch[cnt++] = b;
     }
-
-  /* Get a block from free list and return it. */
-  b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
-  a = block_to_arena (b);
-  a->free_cnt--;
   lock_release (&d->lock);
-  return b;
+
+  if (cnt == 0)
+    return NULL;
+
+  /* Keep BATCH[0] for the caller.  M was empty a moment ago, but
+     another thread or an interrupt handler may have freed into it
+     while we waited for the lock, so only cache what fits and
+     give back the rest. */
+  old_level = intr_disable ();
+  while (cnt > 1 && m->cnt < MAGAZINE_ROUNDS)
+    m->rounds[m->cnt++] = batch[--cnt];
+  intr_set_level (old_level);
+  if (cnt > 1)
+    release_blocks (d, batch + 1, cnt - 1);
+
+  return batch[0];
+}
+
+/* Obtains a page, divides it into blocks for D, and adds them to
+   D's free list.  Returns false if memory is not available.  D's
+   lock must be held. */
+static bool
+new_arena (struct desc *d)
+{
+  struct arena *a;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&d->lock));
+
+  /* Allocate a page. */
+  a = palloc_get_page (0);
+  if (a == NULL)
+    return false;
+
+  /* Initialize arena and add its blocks to the free list. */
+  a->magic = ARENA_MAGIC;
+  a->desc = d;
+  a->free_cnt = d->blocks_per_arena;
+  for (i = 0; i < d->blocks_per_arena; i++)
+    {
+      struct block *b = arena_to_block (a, i);
+      list_push_back (&d->free_list, &b->free_elem);
+    }
+  return true;
 }
 
 /* Allocates and return A times B bytes initialized to zeroes.
@@ -227,32 +315,34 @@ free (void *p)
       if (d != NULL)
         {
           /* It's a normal block.  We handle it here. */
+          struct magazine *m;
+          void *batch[MAGAZINE_ROUNDS / 2];
+          size_t cnt = 0;
+          enum intr_level old_level;
 
 #ifndef NDEBUG
           /* Clear the block to help detect use-after-free bugs. */
           memset (b, 0xcc, d->block_size);
 #endif
 
-          lock_acquire (&d->lock);
-
-          /* Add block to free list. */
-          list_push_front (&d->free_list, &b->free_elem);
-
-          /* If the arena is now entirely unused, free it. */
-          if (++a->free_cnt >= d->blocks_per_arena)
+          /* Put the block in the magazine.  If the magazine is
+             full, first take out its older half, to go back to
+             the free list. */
+          m = &magazines[d - descs];
+          old_level = intr_disable ();
+          if (m->cnt == MAGAZINE_ROUNDS)
             {
-              size_t i;
-
-              ASSERT (a->free_cnt == d->blocks_per_arena);
-              for (i = 0; i < d->blocks_per_arena; i++)
-                {
-                  struct block *b = arena_to_block (a, i);
-                  list_remove (&b->free_elem);
-                }
-              palloc_free_page (a);
+              cnt = MAGAZINE_ROUNDS / 2;
+              memcpy (batch, m->rounds, sizeof batch);
+              memmove (m->rounds, m->rounds + cnt,
+                       (MAGAZINE_ROUNDS - cnt) * sizeof *m->rounds);
+              m->cnt -= cnt;
             }
+          m->rounds[m->cnt++] = b;
+          intr_set_level (old_level);
 
-          lock_release (&d->lock);
+          if (cnt > 0)
+            release_blocks (d, batch, cnt);
         }
       else
         {
@@ -263,6 +353,42 @@ free (void *p)
     }
 }
 
+/* Returns the CNT blocks in BLOCKS, which belong to D, to D's
+   free list, giving back to the page allocator any arena that
+   is left with no blocks in use. */
+static void
+release_blocks (struct desc *d, void **blocks, size_t cnt)
+{
+  size_t i;
+
+  lock_acquire (&d->lock);
+  for (i = 0; i < cnt; i++)
+    {
+      struct block *b = blocks[i];
+      struct arena *a = block_to_arena (b);
+
+      ASSERT (a->desc == d);
+
+      /* Add block to free list. */
+      list_push_front (&d->free_list, &b->free_elem);
+
+      /* If the arena is now entirely unused, free it. */
+      if (++a->free_cnt >= d->blocks_per_arena)
+        {
+          size_t j;
+
+          ASSERT (a->free_cnt == d->blocks_per_arena);
+          for (j = 0; j < d->blocks_per_arena; j++)
+            {
+              struct block *b = arena_to_block (a, j);
+              list_remove (&b->free_elem);
+            }
+          palloc_free_page (a);
+        }
+    }
+  lock_release (&d->lock);
+}
+
 /* Returns the arena that block B is inside. */
 static struct arena *
 block_to_arena (struct block *b)
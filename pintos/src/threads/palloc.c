@@ -1,14 +1,14 @@
 #include "threads/palloc.h"
-#include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
-#include "threads/synch.h"
 #include "threads/vaddr.h"
 
 /* Page allocator.  Hands out memory in page-size (or
@@ -23,14 +23,56 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Each pool is a buddy allocator.  Its free pages are kept as
+   blocks of 2**ORDER pages, each aligned (relative to the pool
+   base) to its own size, on one free list per order.  A request
+   is rounded up to a power of two, carved out of the smallest
+   free block that is big enough, and the unused tail given
+   back; a freed block is merged with its buddy, the block of the
+   same order it was split from, for as long as that buddy is
+   free too.  Both take O(log n) steps whatever the state of the
+   pool, where scanning a bitmap took time proportional to how
+   full and fragmented the pool was.
+
+   Rounding up means that a run of, say, 37 pages needs a free
+   64-page block, even though 37 free pages in a row would do.
+   So if there is no big enough block, allocation falls back to
+   scanning the pool for adjacent free blocks that together
+   cover the run.  That is as slow as the bitmap was, but only
+   happens when the pool is short of large blocks.
+
+   The free lists are protected by disabling interrupts rather
+   than by a lock, because thread_schedule_tail() frees a dying
+   thread's page from inside the scheduler, where it must not
+   block. */
+
+/* Largest block order: 2**16 pages is 256 MB. */
+#define MAX_ORDER 16
+
+/* Per-page state.  The first page of a free block records that
+   it is free and the block's order; every allocated page records
+   PAGE_USED, which does not have the PAGE_FREE bit set.  The
+   other pages of a free block hold stale values that are never
+   looked at. */
+#define PAGE_USED 0x7f
+#define PAGE_FREE 0x80
+#define PAGE_ORDER_MASK 0x7f
 
 /* A memory pool. */
 struct pool
   {
-    struct lock lock;                   /* Mutual exclusion. */
-    struct bitmap *used_map;            /* Bitmap of free pages. */
+    uint8_t *page_state;                /* State of each page. */
+    size_t page_cnt;                    /* Number of pages. */
     uint8_t *base;                      /* Base of pool. */
+    struct list free_lists[MAX_ORDER + 1]; /* Free blocks by order. */
+  };
+
+/* The start of each free block links it into its free list. */
+struct free_block
+  {
+    struct list_elem elem;              /* Element in free_lists[]. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -39,6 +81,8 @@ static struct pool kernel_pool, user_pool;
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static size_t alloc_pages (struct pool *, size_t page_cnt);
+static void free_pages (struct pool *, size_t page_idx, size_t page_cnt);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -73,15 +117,16 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
   void *pages;
   size_t page_idx;
+  enum intr_level old_level;
 
   if (page_cnt == 0)
     return NULL;
 
-  lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
+  old_level = intr_disable ();
+  page_idx = alloc_pages (pool, page_cnt);
+  intr_set_level (old_level);
 
-  if (page_idx != BITMAP_ERROR)
+  if (page_idx != SIZE_MAX)
     pages = pool->base + PGSIZE * page_idx;
   else
     pages = NULL;
@@ -119,6 +164,7 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 {
   struct pool *pool;
   size_t page_idx;
+  enum intr_level old_level;
 
   ASSERT (pg_ofs (pages) == 0);
   if (pages == NULL || page_cnt == 0)
@@ -137,8 +183,9 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
-  ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  old_level = intr_disable ();
+  free_pages (pool, page_idx, page_cnt);
+  intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -148,25 +195,190 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the order of the largest block that can start at page
+   PAGE_IDX and fits in PAGE_CNT pages. */
+static int
+piece_order (size_t page_idx, size_t page_cnt)
+{
+  int order = 31 - __builtin_clz (page_cnt);
+  if (page_idx != 0 && __builtin_ctz (page_idx) < order)
+    order = __builtin_ctz (page_idx);
+  return order < MAX_ORDER ? order : MAX_ORDER;
+}
+
+/* Returns the page with index PAGE_IDX in POOL as a free block. */
+static struct free_block *
+block_at (const struct pool *pool, size_t page_idx)
+{
+  return (struct free_block *) (pool->base + PGSIZE * page_idx);
+}
+
+/* Puts the block of 2**ORDER pages at PAGE_IDX on its free list. */
+static void
+push_block (struct pool *pool, size_t page_idx, int order)
+{
+  pool->page_state[page_idx] = PAGE_FREE | order;
+  list_push_front (&pool->free_lists[order],
+                   &block_at (pool, page_idx)->elem);
+}
+
+/* Frees the block of 2**ORDER pages at PAGE_IDX, merging it with
+   its buddy for as long as the buddy is free as a whole. */
+static void
+release_block (struct pool *pool, size_t page_idx, int order)
+{
+  while (order < MAX_ORDER)
+    {
+      size_t buddy = page_idx ^ ((size_t) 1 << order);
+      if (buddy + ((size_t) 1 << order) > pool->page_cnt
+          || pool->page_state[buddy] != (PAGE_FREE | order))
+        break;
+
+      list_remove (&block_at (pool, buddy)->elem);
+      if (buddy < page_idx)
+        page_idx = buddy;
+      order++;
+    }
+  push_block (pool, page_idx, order);
+}
+
+/* Frees the PAGE_CNT pages at PAGE_IDX, which need not be a
+   single block: they are freed as the largest aligned blocks
+   that tile them. */
+static void
+free_pages (struct pool *pool, size_t page_idx, size_t page_cnt)
+{
+  while (page_cnt > 0)
+    {
+      int order = piece_order (page_idx, page_cnt);
+      size_t block_pages = (size_t) 1 << order;
+      size_t i;
+
+      for (i = 0; i < block_pages; i++)
+        ASSERT (pool->page_state[page_idx + i] == PAGE_USED);
+      release_block (pool, page_idx, order);
+
+      page_idx += block_pages;
+      page_cnt -= block_pages;
+    }
+}
+
+/* Marks the free blocks that tile pages [PAGE_IDX, END) of POOL
+   as used, taking them off their free lists. */
+static void
+take_blocks (struct pool *pool, size_t page_idx, size_t end)
+{
+  while (page_idx < end)
+    {
+      uint8_t state = pool->page_state[page_idx];
+      size_t block_pages;
+
+      ASSERT (state & PAGE_FREE);
+      ASSERT ((state & PAGE_ORDER_MASK) <= MAX_ORDER);
+      block_pages = (size_t) 1 << (state & PAGE_ORDER_MASK);
+      list_remove (&block_at (pool, page_idx)->elem);
+      memset (pool->page_state + page_idx, PAGE_USED, block_pages);
+      page_idx += block_pages;
+    }
+}
+
+/* Allocates PAGE_CNT contiguous pages from POOL out of adjacent
+   free blocks, for when no single free block is big enough.
+   Returns the index of the first page, or SIZE_MAX if there is
+   no such run.
+
+   Walking from the start of the pool, every index we land on is
+   either an allocated page or the first page of a free block,
+   because free blocks are aligned and allocated pages are all
+   marked PAGE_USED. */
+static size_t
+alloc_run (struct pool *pool, size_t page_cnt)
+{
+  size_t start = 0;
+  size_t page_idx = 0;
+
+  while (page_idx < pool->page_cnt)
+    {
+      uint8_t state = pool->page_state[page_idx];
+      if (state == PAGE_USED)
+        {
+          start = ++page_idx;
+          continue;
+        }
+
+      page_idx += (size_t) 1 << (state & PAGE_ORDER_MASK);
+      if (page_idx - start >= page_cnt)
+        {
+          /* Take the whole blocks and give back the part of the
+             last one past PAGE_CNT. */
+          take_blocks (pool, start, page_idx);
+          free_pages (pool, start + page_cnt, page_idx - start - page_cnt);
+          return start;
+        }
+    }
+  return SIZE_MAX;
+}
+
+/* Allocates PAGE_CNT contiguous pages from POOL and returns the
+   index of the first, or SIZE_MAX if there are not that many
+   free pages in a row. */
+static size_t
+alloc_pages (struct pool *pool, size_t page_cnt)
+{
+  int want = page_cnt > 1 ? 32 - __builtin_clz (page_cnt - 1) : 0;
+  int order;
+  struct free_block *block;
+  size_t page_idx;
+
+  /* Find the smallest free block that is big enough. */
+  for (order = want; order <= MAX_ORDER; order++)
+    if (!list_empty (&pool->free_lists[order]))
+      break;
+  if (order > MAX_ORDER)
+    return alloc_run (pool, page_cnt);
+
+  block = list_entry (list_pop_front (&pool->free_lists[order]),
+                      struct free_block, elem);
+  page_idx = pg_no (block) - pg_no (pool->base);
+
+  /* Split it down to the order we want, freeing the upper
+     halves. */
+  while (order > want)
+    {
+      order--;
+      push_block (pool, page_idx + ((size_t) 1 << order), order);
+    }
+
+  /* Give back the pages past PAGE_CNT. */
+  memset (pool->page_state + page_idx, PAGE_USED, (size_t) 1 << want);
+  free_pages (pool, page_idx + page_cnt, ((size_t) 1 << want) - page_cnt);
+  return page_idx;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
 init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
+  /* We'll put the pool's page_state at its base.
+     Calculate the space needed for it
      and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
-  if (bm_pages > page_cnt)
-    PANIC ("Not enough memory in %s for bitmap.", name);
-  page_cnt -= bm_pages;
+  size_t state_pages = DIV_ROUND_UP (page_cnt, PGSIZE);
+  int order;
+  if (state_pages > page_cnt)
+    PANIC ("Not enough memory in %s for page states.", name);
+  page_cnt -= state_pages;
 
   printf ("%zu pages available in %s.\n", page_cnt, name);
 
-  /* Initialize the pool. */
-  lock_init (&p->lock);
-  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  /* Initialize the pool, with every page free. */
+  p->page_state = base;
+  p->page_cnt = page_cnt;
+  p->base = base + state_pages * PGSIZE;
+  for (order = 0; order <= MAX_ORDER; order++)
+    list_init (&p->free_lists[order]);
+  memset (p->page_state, PAGE_USED, page_cnt);
+  free_pages (p, 0, page_cnt);
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -176,7 +388,7 @@ page_from_pool (const struct pool *pool, void *page)
 {
   size_t page_no = pg_no (page);
   size_t start_page = pg_no (pool->base);
-  size_t end_page = start_page + bitmap_size (pool->used_map);
+  size_t end_page = start_page + pool->page_cnt;
 
   return page_no >= start_page && page_no < end_page;
 }
@@ -0,0 +1,227 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A slab allocator for objects of one fixed size.
+
+   malloc() rounds every request up to a power of 2, so a
+   600-byte object takes a 1 kB block.  A kmem_cache instead
+   carves pages, called "slabs", into slots of exactly the
+   object's size (rounded up only to pointer alignment), with a
+   small header at the start of each page.
+
+   Free objects in a slab are kept on a singly linked list
+   threaded through the objects themselves.  If the cache has a
+   constructor, it is run on each object once, when its slab is
+   created, and objects are expected to be back in their
+   constructed state when freed; so that the link does not
+   overwrite that state, it is then kept in an extra word after
+   the object instead of in its first bytes.
+
+   The cache keeps a list of the slabs that have at least one
+   free object.  A slab whose objects are all free is given back
+   to the page allocator, unless it is the only slab on that
+   list, so that a cache going back and forth between zero and
+   one objects does not allocate and free a page every time. */
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Header at the start of each slab. */
+struct slab
+  {
+    unsigned magic;                     /* Always set to SLAB_MAGIC. */
+    struct kmem_cache *cache;           /* Owning cache. */
+    struct list_elem elem;              /* In cache's partial_slabs. */
+    size_t free_cnt;                    /* Number of free objects. */
+    void *free_list;                    /* First free object. */
+  };
+
+/* Offset of the first object in a slab. */
+#define SLAB_HEADER_SIZE ROUND_UP (sizeof (struct slab), sizeof (void *))
+
+/* All caches, for kmem_cache_print_stats(). */
+static struct list all_caches = LIST_INITIALIZER (all_caches);
+
+static struct slab *new_slab (struct kmem_cache *);
+static struct slab *object_to_slab (struct kmem_cache *, void *);
+
+/* Returns the free-list link in free object OBJ of cache C. */
+static inline void **
+object_link (const struct kmem_cache *c, void *obj)
+{
+  return (void **) ((uint8_t *) obj + c->link_ofs);
+}
+
+/* Initializes C as a cache of SIZE-byte objects, named NAME.  If
+   CTOR is nonnull, it is called on every object when the object
+   is first created. */
+void
+kmem_cache_init (struct kmem_cache *c, const char *name, size_t size,
+                 kmem_ctor_func *ctor)
+{
+  ASSERT (c != NULL);
+  ASSERT (size > 0);
+
+  c->name = name;
+  c->object_size = size;
+  c->slot_size = ROUND_UP (size, sizeof (void *));
+  if (ctor != NULL)
+    {
+      c->link_ofs = c->slot_size;
+      c->slot_size += sizeof (void *);
+    }
+  else
+    c->link_ofs = 0;
+  ASSERT (c->slot_size <= PGSIZE - SLAB_HEADER_SIZE);
+  c->objects_per_slab = (PGSIZE - SLAB_HEADER_SIZE) / c->slot_size;
+  c->ctor = ctor;
+  lock_init (&c->lock);
+  list_init (&c->partial_slabs);
+
+  c->alloc_cnt = c->free_cnt = 0;
+  c->in_use = c->peak_in_use = c->slab_cnt = 0;
+
+  list_push_back (&all_caches, &c->elem);
+}
+
+/* Obtains and returns an object from cache C.  Returns a null
+   pointer if memory is not available.  Unlike malloc(), the
+   object's contents are whatever the constructor or the last
+   user left in it. */
+void *
+kmem_cache_alloc (struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  lock_acquire (&c->lock);
+  if (list_empty (&c->partial_slabs))
+    {
+      s = new_slab (c);
+      if (s == NULL)
+        {
+          lock_release (&c->lock);
+          return NULL;
+        }
+      list_push_front (&c->partial_slabs, &s->elem);
+    }
+  else
+    s = list_entry (list_front (&c->partial_slabs), struct slab, elem);
+
+  /* Take the slab's first free object. */
+  obj = s->free_list;
+  s->free_list = *object_link (c, obj);
+  if (--s->free_cnt == 0)
+    list_remove (&s->elem);
+
+  c->alloc_cnt++;
+  if (++c->in_use > c->peak_in_use)
+    c->peak_in_use = c->in_use;
+  lock_release (&c->lock);
+
+  return obj;
+}
+
+/* Returns OBJ, which must have been obtained from cache C, to C.
+   Does nothing if OBJ is a null pointer. */
+void
+kmem_cache_free (struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  if (obj == NULL)
+    return;
+
+  s = object_to_slab (c, obj);
+
+  lock_acquire (&c->lock);
+  *object_link (c, obj) = s->free_list;
+  s->free_list = obj;
+  if (s->free_cnt++ == 0)
+    list_push_front (&c->partial_slabs, &s->elem);
+
+  /* Give back the slab if it is now unused and not the only one
+     with free objects. */
+  if (s->free_cnt == c->objects_per_slab
+      && list_begin (&c->partial_slabs) != list_rbegin (&c->partial_slabs))
+    {
+      list_remove (&s->elem);
+      palloc_free_page (s);
+      c->slab_cnt--;
+    }
+
+  c->free_cnt++;
+  c->in_use--;
+  lock_release (&c->lock);
+}
+
+/* Prints statistics for every cache. */
+void
+kmem_cache_print_stats (void)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&all_caches); e != list_end (&all_caches);
+       e = list_next (e))
+    {
+      struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+      printf ("Cache %s: %zu-byte objects, %zu per slab, "
+              "%llu allocs, %llu frees, %zu in use (peak %zu), "
+              "%zu slabs\n",
+              c->name, c->object_size, c->objects_per_slab,
+              c->alloc_cnt, c->free_cnt, c->in_use, c->peak_in_use,
+              c->slab_cnt);
+    }
+}
+
+/* Obtains a page for cache C and divides it into free objects,
+   running C's constructor on each.  Returns the new slab, or a
+   null pointer if memory is not available.  C's lock must be
+   held. */
+static struct slab *
+new_slab (struct kmem_cache *c)
+{
+  struct slab *s;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  s = palloc_get_page (0);
+  if (s == NULL)
+    return NULL;
+
+  s->magic = SLAB_MAGIC;
+  s->cache = c;
+  s->free_cnt = c->objects_per_slab;
+  s->free_list = NULL;
+  for (i = c->objects_per_slab; i-- > 0; )
+    {
+      void *obj = (uint8_t *) s + SLAB_HEADER_SIZE + i * c->slot_size;
+      if (c->ctor != NULL)
+        c->ctor (obj);
+      *object_link (c, obj) = s->free_list;
+      s->free_list = obj;
+    }
+
+  c->slab_cnt++;
+  return s;
+}
+
+/* Returns the slab that OBJ, an object from cache C, is in. */
+static struct slab *
+object_to_slab (struct kmem_cache *c, void *obj)
+{
+  struct slab *s = pg_round_down (obj);
+
+  /* Check that the slab is valid and OBJ is one of its slots. */
+  ASSERT (s->magic == SLAB_MAGIC);
+  ASSERT (s->cache == c);
+  ASSERT ((pg_ofs (obj) - SLAB_HEADER_SIZE) % c->slot_size == 0);
+
+  return s;
+}
@@ -0,0 +1,39 @@
+#ifndef THREADS_SLAB_H
+#define THREADS_SLAB_H
+
+#include <list.h>
+#include <stddef.h>
+#include "threads/synch.h"
+
+/* Initializes a newly created object. */
+typedef void kmem_ctor_func (void *);
+
+/* A cache of objects that all have the same size.  See slab.c. */
+struct kmem_cache
+  {
+    const char *name;                   /* Name, for statistics. */
+    size_t object_size;                 /* Size of each object. */
+    size_t slot_size;                   /* Bytes per object in a slab. */
+    size_t link_ofs;                    /* Free-list link in a free object. */
+    size_t objects_per_slab;            /* Objects in each slab. */
+    kmem_ctor_func *ctor;               /* Constructor, or null. */
+    struct lock lock;                   /* Protects the members below. */
+    struct list partial_slabs;          /* Slabs with a free object. */
+
+    /* Statistics. */
+    unsigned long long alloc_cnt;       /* # of kmem_cache_alloc() calls. */
+    unsigned long long free_cnt;        /* # of kmem_cache_free() calls. */
+    size_t in_use;                      /* Objects allocated now. */
+    size_t peak_in_use;                 /* Most objects ever in use. */
+    size_t slab_cnt;                    /* Pages held by the cache. */
+
+    struct list_elem elem;              /* Element in list of caches. */
+  };
+
+void kmem_cache_init (struct kmem_cache *, const char *name, size_t size,
+                      kmem_ctor_func *);
+void *kmem_cache_alloc (struct kmem_cache *);
+void kmem_cache_free (struct kmem_cache *, void *);
+void kmem_cache_print_stats (void);
+
+#endif /* threads/slab.h */
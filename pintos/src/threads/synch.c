@@ -51,7 +51,8 @@ sema_init (struct semaphore *sema, unsigned value)
 }
 
 /* Down or "P" operation on a semaphore.  Waits for SEMA's value
-   to become positive and then atomically decrements it.
+   to become positive and then atomically decrements it.  Waiters
+   are kept in order of priority, highest first.
 
    This function may sleep, so it must not be called within an
    interrupt handler.  This function may be called with
@@ -68,7 +69,10 @@ sema_down (struct semaphore *sema)
   old_level = intr_disable ();
   while (sema->value == 0)
     {
-      list_push_back (&sema->waiters, &thread_current ()->elem);
+      struct thread *cur = thread_current ();
+      list_insert_ordered (&sema->waiters, &cur->elem,
+                           thread_priority_greater, NULL);
+      cur->wait_queue = &sema->waiters;
       thread_block ();
     }
   sema->value--;
@@ -102,9 +106,12 @@ sema_try_down (struct semaphore *sema)
 }
 
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
-   and wakes up one thread of those waiting for SEMA, if any.
+   and wakes up the highest-priority thread of those waiting for
+   SEMA, if any, yielding to it if it has a higher priority than
+   the current thread.
 
-   This function may be called from an interrupt handler. */
+   This function may be called from an interrupt handler, in
+   which case the yield happens when the handler returns. */
 void
 sema_up (struct semaphore *sema)
 {
@@ -114,10 +121,15 @@ sema_up (struct semaphore *sema)
 
   old_level = intr_disable ();
   if (!list_empty (&sema->waiters))
-    thread_unblock (list_entry (list_pop_front (&sema->waiters),
-                                struct thread, elem));
+    {
+      struct thread *t = list_entry (list_pop_front (&sema->waiters),
+                                     struct thread, elem);
+      t->wait_queue = NULL;
+      thread_unblock (t);
+    }
   sema->value++;
   intr_set_level (old_level);
+  thread_check_preemption ();
 }
 
 static void sema_test_helper (void *sema_);
@@ -179,12 +191,76 @@ lock_init (struct lock *lock)
 
   lock->holder = NULL;
   sema_init (&lock->semaphore, 1);
+  lock->max_priority = PRI_MIN;
+}
+
+/* Returns the highest priority among the threads waiting for
+   LOCK, or PRI_MIN if there are none.  The waiters are in
+   priority order, so this is the first one's. */
+static int
+lock_waiters_priority (struct lock *lock)
+{
+  struct list *waiters = &lock->semaphore.waiters;
+
+  if (list_empty (waiters))
+    return PRI_MIN;
+  return list_entry (list_front (waiters), struct thread, elem)->priority;
+}
+
+/* Makes the current thread, which holds LOCK, its owner for the
+   purposes of donation: the priorities of threads still waiting
+   for LOCK are donated to it. */
+static void
+lock_take (struct lock *lock)
+{
+  struct thread *cur = thread_current ();
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  lock->holder = cur;
+  lock->max_priority = lock_waiters_priority (lock);
+  list_push_back (&cur->held_locks, &lock->elem);
+  if (!thread_mlfqs)
+    thread_recompute_priority (cur);
+}
+
+/* Donates thread T's priority down the chain of locks that T is
+   waiting for: to the holder of T's lock, to the holder of the
+   lock that thread is waiting for, and so on.  The walk stops as
+   soon as a lock already carries at least T's priority, because
+   everything beyond it does too, so a deep chain costs only as
+   many steps as there are threads whose priority actually
+   rises. */
+static void
+donate_priority (struct thread *t)
+{
+  int priority = t->priority;
+  struct lock *lock = t->waiting_lock;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  while (lock != NULL && lock->holder != NULL
+         && lock->max_priority < priority)
+    {
+      lock->max_priority = priority;
+      thread_recompute_priority (lock->holder);
+      lock = lock->holder->waiting_lock;
+    }
 }
 
 /* Acquires LOCK, sleeping until it becomes available if
    necessary.  The lock must not already be held by the current
    thread.
 
+   While the current thread waits, its priority is donated to
+   the holder of LOCK (and onward, if the holder is itself
+   waiting for a lock), unless the MLFQS scheduler is in use.
+   Being woken up does not guarantee getting the lock: another
+   thread may take it first, having computed its donations
+   without us, since we are no longer on the waiters list.  So
+   every time we find the lock taken, we donate again before
+   going back to sleep.
+
    This function may sleep, so it must not be called within an
    interrupt handler.  This function may be called with
    interrupts disabled, but interrupts will be turned back on if
@@ -192,12 +268,31 @@ lock_init (struct lock *lock)
 void
 lock_acquire (struct lock *lock)
 {
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
   ASSERT (lock != NULL);
   ASSERT (!intr_context ());
   ASSERT (!lock_held_by_current_thread (lock));
 
-  sema_down (&lock->semaphore);
-  lock->holder = thread_current ();
+  old_level = intr_disable ();
+  while (!sema_try_down (&lock->semaphore))
+    {
+      struct list *waiters = &lock->semaphore.waiters;
+
+      cur->waiting_lock = lock;
+      if (!thread_mlfqs)
+        donate_priority (cur);
+
+      /* Wait, as in sema_down(), until lock_release() wakes us. */
+      list_insert_ordered (waiters, &cur->elem, thread_priority_greater,
+                           NULL);
+      cur->wait_queue = waiters;
+      thread_block ();
+    }
+  cur->waiting_lock = NULL;
+  lock_take (lock);
+  intr_set_level (old_level);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -209,18 +304,23 @@ lock_acquire (struct lock *lock)
 bool
 lock_try_acquire (struct lock *lock)
 {
+  enum intr_level old_level;
   bool success;
 
   ASSERT (lock != NULL);
   ASSERT (!lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
   success = sema_try_down (&lock->semaphore);
   if (success)
-    lock->holder = thread_current ();
+    lock_take (lock);
+  intr_set_level (old_level);
   return success;
 }
 
 /* Releases LOCK, which must be owned by the current thread.
+   Priority donated through LOCK is given up, and the current
+   thread yields if one of its waiters now outranks it.
 
    An interrupt handler cannot acquire a lock, so it does not
    make sense to try to release a lock within an interrupt
@@ -228,11 +328,19 @@ lock_try_acquire (struct lock *lock)
 void
 lock_release (struct lock *lock)
 {
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
   ASSERT (lock != NULL);
   ASSERT (lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
   lock->holder = NULL;
+  list_remove (&lock->elem);
+  if (!thread_mlfqs)
+    thread_recompute_priority (cur);
   sema_up (&lock->semaphore);
+  intr_set_level (old_level);
 }
 
 /* Returns true if the current thread holds LOCK, false
@@ -251,8 +359,21 @@ struct semaphore_elem
   {
     struct list_elem elem;              /* List element. */
     struct semaphore semaphore;         /* This semaphore. */
+    int priority;                       /* Waiting thread's priority. */
   };
 
+/* Orders condition variable waiters by priority, highest first,
+   keeping waiters of equal priority in FIFO order. */
+static bool
+waiter_priority_greater (const struct list_elem *a_,
+                         const struct list_elem *b_, void *aux UNUSED)
+{
+  const struct semaphore_elem *a = list_entry (a_, struct semaphore_elem, elem);
+  const struct semaphore_elem *b = list_entry (b_, struct semaphore_elem, elem);
+
+  return a->priority > b->priority;
+}
+
 /* Initializes condition variable COND.  A condition variable
    allows one piece of code to signal a condition and cooperating
    code to receive the signal and act upon it. */
@@ -295,14 +416,17 @@ cond_wait (struct condition *cond, struct lock *lock)
   ASSERT (lock_held_by_current_thread (lock));
 
   sema_init (&waiter.semaphore, 0);
-  list_push_back (&cond->waiters, &waiter.elem);
+  waiter.priority = thread_get_priority ();
+  list_insert_ordered (&cond->waiters, &waiter.elem,
+                       waiter_priority_greater, NULL);
   lock_release (lock);
   sema_down (&waiter.semaphore);
   lock_acquire (lock);
 }
 
 /* If any threads are waiting on COND (protected by LOCK), then
-   this function signals one of them to wake up from its wait.
+   this function signals the one with the highest priority (as
+   of when it started waiting) to wake up from its wait.
    LOCK must be held before calling this function.
 
    An interrupt handler cannot acquire a lock, so it does not
@@ -336,3 +460,132 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes readers-writer lock RWLOCK, with no holders. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->can_read);
+  cond_init (&rwlock->can_write);
+  rwlock->readers = 0;
+  rwlock->waiting_writers = 0;
+  rwlock->writer = NULL;
+}
+
+/* Acquires RWLOCK for reading, sleeping while a writer holds it
+   or is waiting for it.  Waiters are woken in priority order.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_for_write (rwlock));
+
+  lock_acquire (&rwlock->lock);
+  while (rwlock->writer != NULL || rwlock->waiting_writers > 0)
+    cond_wait (&rwlock->can_read, &rwlock->lock);
+  rwlock->readers++;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for reading.
+   The last reader out lets a waiting writer in. */
+void
+rwlock_release_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->readers > 0);
+  if (--rwlock->readers == 0 && rwlock->waiting_writers > 0)
+    cond_signal (&rwlock->can_write, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK for writing, sleeping until no other thread
+   holds it at all.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rwlock_held_for_write (rwlock));
+
+  lock_acquire (&rwlock->lock);
+  rwlock->waiting_writers++;
+  while (rwlock->writer != NULL || rwlock->readers > 0)
+    cond_wait (&rwlock->can_write, &rwlock->lock);
+  rwlock->waiting_writers--;
+  rwlock->writer = thread_current ();
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for writing.
+   Another waiting writer goes next; otherwise every waiting
+   reader is let in. */
+void
+rwlock_release_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (rwlock_held_for_write (rwlock));
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer = NULL;
+  if (rwlock->waiting_writers > 0)
+    cond_signal (&rwlock->can_write, &rwlock->lock);
+  else
+    cond_broadcast (&rwlock->can_read, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Returns true if the current thread holds RWLOCK for writing.
+   (Which threads hold it for reading is not tracked.) */
+bool
+rwlock_held_for_write (const struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  return rwlock->writer == thread_current ();
+}
+
+/* Initializes SPINLOCK as not held. */
+void
+spin_init (struct spinlock *spinlock)
+{
+  ASSERT (spinlock != NULL);
+
+  spinlock->held = false;
+}
+
+/* Acquires SPINLOCK by turning interrupts off.  Must not be
+   held across anything that sleeps. */
+void
+spin_lock (struct spinlock *spinlock)
+{
+  enum intr_level old_level = intr_disable ();
+
+  ASSERT (!spinlock->held);
+  spinlock->held = true;
+  spinlock->old_level = old_level;
+}
+
+/* Releases SPINLOCK, restoring the interrupt level from before
+   spin_lock(). */
+void
+spin_unlock (struct spinlock *spinlock)
+{
+  ASSERT (spinlock->held);
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  spinlock->held = false;
+  intr_set_level (spinlock->old_level);
+}
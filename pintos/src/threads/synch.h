@@ -3,6 +3,7 @@
 
 #include <list.h>
 #include <stdbool.h>
+#include "threads/interrupt.h"
 
 /* A counting semaphore. */
 struct semaphore
@@ -20,8 +21,10 @@ void sema_self_test (void);
 /* Lock. */
 struct lock
   {
-    struct thread *holder;      /* Thread holding lock (for debugging). */
+    struct thread *holder;      /* Thread holding lock. */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
+    struct list_elem elem;      /* Element in holder's held_locks. */
+    int max_priority;           /* Highest priority donated by a waiter. */
   };
 
 void lock_init (struct lock *);
@@ -41,6 +44,46 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.  Any number of threads may hold it for
+   reading at once, or one thread for writing.  Writers are
+   preferred: once a writer is waiting, new readers wait behind
+   it, so a steady stream of readers cannot starve writers. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition can_read;  /* Signaled when readers may enter. */
+    struct condition can_write; /* Signaled when a writer may enter. */
+    int readers;                /* # of threads holding it for reading. */
+    int waiting_writers;        /* # of threads waiting to write. */
+    struct thread *writer;      /* Thread holding it for writing. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
+/* Spinlock.
+
+   Pintos runs on one CPU, so the only way another thread can get
+   into a critical section is by being switched to from a timer
+   or other interrupt.  A "spinlock" therefore just turns
+   interrupts off, and never actually spins.  Use it only for a
+   handful of instructions that must not sleep, such as updating
+   a counter shared with readers that hold an rwlock.  Anything
+   longer should use a lock, which leaves interrupts on. */
+struct spinlock
+  {
+    enum intr_level old_level;  /* Interrupt level to restore. */
+    bool held;                  /* For catching recursive use. */
+  };
+
+void spin_init (struct spinlock *);
+void spin_lock (struct spinlock *);
+void spin_unlock (struct spinlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -11,6 +11,7 @@
 #include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
@@ -20,9 +21,14 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Processes in THREAD_READY state, that is, processes that are
+   ready to run but not actually running, in one FIFO list per
+   priority.  Bit P of ready_levels is set exactly when
+   ready_lists[P] is non-empty, so finding the highest priority
+   ready to run is a single bit scan. */
+static struct list ready_lists[PRI_MAX + 1];
+static uint64_t ready_levels;
+static int ready_count;         /* # of threads in ready_lists. */
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
@@ -50,11 +56,28 @@ static long long idle_ticks;    /* # of timer ticks spent idle. */
 static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
 static long long user_ticks;    /* # of timer ticks in user programs. */
 
+/* Scheduler statistics over all threads, including those that
+   have exited.  Per-thread counts live in struct thread.  Times
+   are in CPU cycles, read from the time-stamp counter. */
+static long long voluntary_switches;    /* # of switches on blocking. */
+static long long involuntary_switches;  /* # of switches on yielding. */
+static uint64_t max_wakeup_latency;     /* Longest unblock-to-run time. */
+
 /* Scheduling. */
 #define TIME_SLICE 4            /* # of timer ticks to give each thread. */
 static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 
-/* If false (default), use round-robin scheduler.
+/* Multi-level feedback queue scheduler.  recent_cpu grows only
+   for the running thread, so between the once-a-second updates
+   of every thread only threads that ran can need a new priority.
+   Those are kept on mlfqs_dirty_list until the next multiple of
+   MLFQS_PRIORITY_TICKS, which keeps the work done in the timer
+   interrupt independent of the number of threads. */
+#define MLFQS_PRIORITY_TICKS 4  /* Ticks between priority updates. */
+static fixed_point_t load_avg;  /* Estimated # of ready threads. */
+static struct list mlfqs_dirty_list;
+
+/* If false (default), use priority scheduler.
    If true, use multi-level feedback queue scheduler.
    Controlled by kernel command-line option "-o mlfqs". */
 bool thread_mlfqs;
@@ -64,6 +87,16 @@ static void kernel_thread (thread_func *, void *aux);
 static void idle (void *aux UNUSED);
 static struct thread *running_thread (void);
 static struct thread *next_thread_to_run (void);
+static void ready_list_push (struct thread *);
+static void ready_list_remove (struct thread *);
+static int highest_ready_priority (void);
+static void set_effective_priority (struct thread *, int priority);
+static int mlfqs_priority (const struct thread *);
+static void mlfqs_tick (struct thread *);
+static void mlfqs_mark_dirty (struct thread *);
+static void mlfqs_decay_recent_cpu (struct thread *, void *aux);
+static void print_thread_stats (struct thread *, void *aux);
+static inline uint64_t read_tsc (void);
 static void init_thread (struct thread *, const char *name, int priority);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
@@ -76,7 +109,7 @@ static tid_t allocate_tid (void);
    general and it is possible in this case only because loader.S
    was careful to put the bottom of the stack at a page boundary.
 
-   Also initializes the run queue and the tid lock.
+   Also initializes the run queues and the tid lock.
 
    After calling this function, be sure to initialize the page
    allocator before trying to create any threads with
@@ -87,16 +120,24 @@ static tid_t allocate_tid (void);
 void
 thread_init (void)
 {
+  int priority;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (priority = PRI_MIN; priority <= PRI_MAX; priority++)
+    list_init (&ready_lists[priority]);
+  ready_levels = 0;
+  ready_count = 0;
   list_init (&all_list);
+  list_init (&mlfqs_dirty_list);
+  load_avg = fix_int (0);
 
   /* Set up a thread structure for the running thread. */
   initial_thread = running_thread ();
   init_thread (initial_thread, "main", PRI_DEFAULT);
   initial_thread->status = THREAD_RUNNING;
+  initial_thread->run_since = read_tsc ();
   initial_thread->tid = allocate_tid ();
 }
 
@@ -134,17 +175,51 @@ thread_tick (void)
   else
     kernel_ticks++;
 
+  if (thread_mlfqs)
+    mlfqs_tick (t);
+
   /* Enforce preemption. */
   if (++thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
 }
 
-/* Prints thread statistics. */
+/* Returns the CPU's time-stamp counter. */
+static inline uint64_t
+read_tsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Prints thread statistics: tick totals, then scheduler counts
+   over all threads and for each thread still alive. */
 void
 thread_print_stats (void)
 {
+  enum intr_level old_level;
+
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
           idle_ticks, kernel_ticks, user_ticks);
+  printf ("Scheduler: %lld voluntary, %lld involuntary switches, "
+          "max wakeup latency %llu cycles\n",
+          voluntary_switches, involuntary_switches, max_wakeup_latency);
+
+  old_level = intr_disable ();
+  thread_foreach (print_thread_stats, NULL);
+  intr_set_level (old_level);
+}
+
+/* Prints thread T's scheduler statistics. */
+static void
+print_thread_stats (struct thread *t, void *aux UNUSED)
+{
+  printf ("  %s (tid %d): %llu cycles ready, %llu running, "
+          "%u voluntary, %u involuntary switches, "
+          "max wakeup latency %llu\n",
+          t->name, t->tid, t->ready_cycles, t->run_cycles,
+          t->voluntary_switches, t->involuntary_switches,
+          t->max_wakeup_latency);
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -157,11 +232,8 @@ thread_print_stats (void)
    before thread_create() returns.  Contrariwise, the original
    thread may run for any amount of time before the new thread is
    scheduled.  Use a semaphore or some other form of
-   synchronization if you need to ensure ordering.
-
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   synchronization if you need to ensure ordering.  In particular,
+   a new thread of higher priority than the caller runs at once. */
 tid_t
 thread_create (const char *name, int priority,
                thread_func *function, void *aux)
@@ -200,6 +272,7 @@ thread_create (const char *name, int priority,
 
   /* Add to run queue. */
   thread_unblock (t);
+  thread_check_preemption ();
 
   return tid;
 }
@@ -224,10 +297,11 @@ thread_block (void)
    This is an error if T is not blocked.  (Use thread_yield() to
    make the running thread ready.)
 
-   This function does not preempt the running thread.  This can
-   be important: if the caller had disabled interrupts itself,
-   it may expect that it can atomically unblock a thread and
-   update other data. */
+   This function does not preempt the running thread, even if T
+   has a higher priority.  This can be important: if the caller
+   had disabled interrupts itself, it may expect that it can
+   atomically unblock a thread and update other data.  Call
+   thread_check_preemption() afterward to let T run. */
 void
 thread_unblock (struct thread *t)
 {
@@ -237,8 +311,10 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_back (&ready_list, &t->elem);
+  ready_list_push (t);
   t->status = THREAD_READY;
+  t->ready_since = read_tsc ();
+  t->woken = true;
   intr_set_level (old_level);
 }
 
@@ -291,6 +367,8 @@ thread_exit (void)
      when it calls thread_schedule_tail(). */
   intr_disable ();
   list_remove (&thread_current()->allelem);
+  if (thread_current ()->mlfqs_dirty)
+    list_remove (&thread_current ()->dirtyelem);
   thread_current ()->status = THREAD_DYING;
   schedule ();
   NOT_REACHED ();
@@ -308,12 +386,34 @@ thread_yield (void)
 
   old_level = intr_disable ();
   if (cur != idle_thread)
-    list_push_back (&ready_list, &cur->elem);
+    ready_list_push (cur);
   cur->status = THREAD_READY;
+  cur->ready_since = read_tsc ();
   schedule ();
   intr_set_level (old_level);
 }
 
+/* Yields the CPU if some ready thread has a higher priority than
+   the running thread.  Called from an interrupt handler, the
+   yield happens when the handler returns. */
+void
+thread_check_preemption (void)
+{
+  enum intr_level old_level;
+  bool outranked;
+
+  old_level = intr_disable ();
+  outranked = highest_ready_priority () > thread_current ()->priority;
+  intr_set_level (old_level);
+
+  if (!outranked)
+    return;
+  if (intr_context ())
+    intr_yield_on_return ();
+  else
+    thread_yield ();
+}
+
 /* Invoke function 'func' on all threads, passing along 'aux'.
    This function must be called with interrupts off. */
 void
@@ -331,49 +431,202 @@ thread_foreach (thread_action_func *func, void *aux)
     }
 }
 
-/* Sets the current thread's priority to NEW_PRIORITY. */
+/* Sets the current thread's base priority to NEW_PRIORITY,
+   yielding if it no longer has the highest priority.  Priority
+   donated to the thread still applies until the locks it holds
+   are released.  Does nothing under the MLFQS scheduler, which
+   sets priorities itself. */
 void
 thread_set_priority (int new_priority)
 {
-  thread_current ()->priority = new_priority;
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+  if (thread_mlfqs)
+    return;
+
+  old_level = intr_disable ();
+  cur->base_priority = new_priority;
+  thread_recompute_priority (cur);
+  intr_set_level (old_level);
+
+  thread_check_preemption ();
+}
+
+/* Sets T's effective priority to its base priority or the
+   highest priority donated through any lock it holds, whichever
+   is higher, and moves T to the matching run queue if it is
+   ready.  Each held lock caches the highest priority among its
+   waiters, so this costs one step per held lock, however many
+   threads are waiting.  Must be called with interrupts off. */
+void
+thread_recompute_priority (struct thread *t)
+{
+  int priority = t->base_priority;
+  struct list_elem *e;
+
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (e = list_begin (&t->held_locks); e != list_end (&t->held_locks);
+       e = list_next (e))
+    {
+      struct lock *lock = list_entry (e, struct lock, elem);
+      if (lock->max_priority > priority)
+        priority = lock->max_priority;
+    }
+
+  set_effective_priority (t, priority);
 }
 
-/* Returns the current thread's priority. */
+/* Orders threads by effective priority, highest first.  Used
+   with list_insert_ordered(), which keeps threads of equal
+   priority in FIFO order. */
+bool
+thread_priority_greater (const struct list_elem *a_,
+                         const struct list_elem *b_, void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->priority > b->priority;
+}
+
+/* Returns the current thread's effective priority. */
 int
 thread_get_priority (void)
 {
   return thread_current ()->priority;
 }
 
-/* Sets the current thread's nice value to NICE. */
+/* Sets the current thread's nice value to NICE and recalculates
+   its priority, yielding if it no longer has the highest
+   priority. */
 void
-thread_set_nice (int nice UNUSED)
+thread_set_nice (int nice)
 {
-  /* Not yet implemented. */
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  ASSERT (NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable ();
+  cur->nice = nice;
+  if (thread_mlfqs)
+    set_effective_priority (cur, mlfqs_priority (cur));
+  intr_set_level (old_level);
+
+  thread_check_preemption ();
 }
 
 /* Returns the current thread's nice value. */
 int
 thread_get_nice (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  return thread_current ()->nice;
 }
 
 /* Returns 100 times the system load average. */
 int
 thread_get_load_avg (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int value = fix_round (fix_scale (load_avg, 100));
+  intr_set_level (old_level);
+  return value;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int
 thread_get_recent_cpu (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int value = fix_round (fix_scale (thread_current ()->recent_cpu, 100));
+  intr_set_level (old_level);
+  return value;
+}
+
+/* Returns the priority the MLFQS scheduler gives T:
+   PRI_MAX - recent_cpu / 4 - nice * 2, clamped to the valid
+   range. */
+static int
+mlfqs_priority (const struct thread *t)
+{
+  int priority = PRI_MAX - fix_trunc (fix_unscale (t->recent_cpu, 4))
+                 - t->nice * 2;
+
+  if (priority < PRI_MIN)
+    return PRI_MIN;
+  if (priority > PRI_MAX)
+    return PRI_MAX;
+  return priority;
+}
+
+/* Does the MLFQS bookkeeping for a timer tick that found T
+   running.  Runs in the timer interrupt. */
+static void
+mlfqs_tick (struct thread *t)
+{
+  int64_t ticks = timer_ticks ();
+
+  if (t != idle_thread)
+    {
+      t->recent_cpu = fix_add (t->recent_cpu, fix_int (1));
+      mlfqs_mark_dirty (t);
+    }
+
+  if (ticks % TIMER_FREQ == 0)
+    {
+      int ready_threads = ready_count + (t != idle_thread);
+      load_avg = fix_add (fix_mul (fix_frac (59, 60), load_avg),
+                          fix_scale (fix_frac (1, 60), ready_threads));
+      thread_foreach (mlfqs_decay_recent_cpu, NULL);
+    }
+
+  if (ticks % MLFQS_PRIORITY_TICKS == 0)
+    {
+      while (!list_empty (&mlfqs_dirty_list))
+        {
+          struct thread *d = list_entry (list_pop_front (&mlfqs_dirty_list),
+                                         struct thread, dirtyelem);
+          d->mlfqs_dirty = false;
+          set_effective_priority (d, mlfqs_priority (d));
+        }
+      thread_check_preemption ();
+    }
+}
+
+/* Queues T for a priority update at the next multiple of
+   MLFQS_PRIORITY_TICKS. */
+static void
+mlfqs_mark_dirty (struct thread *t)
+{
+  if (!t->mlfqs_dirty)
+    {
+      t->mlfqs_dirty = true;
+      list_push_back (&mlfqs_dirty_list, &t->dirtyelem);
+    }
+}
+
+/* Applies the once-a-second decay to T's recent_cpu:
+   recent_cpu = (2 * load_avg) / (2 * load_avg + 1) * recent_cpu
+   + nice.  A thread whose recent_cpu and nice are both zero is
+   unaffected and is left off the dirty list. */
+static void
+mlfqs_decay_recent_cpu (struct thread *t, void *aux UNUSED)
+{
+  fixed_point_t twice_load;
+
+  if (t == idle_thread || (t->recent_cpu.f == 0 && t->nice == 0))
+    return;
+
+  twice_load = fix_scale (load_avg, 2);
+  t->recent_cpu = fix_add (fix_mul (fix_div (twice_load,
+                                             fix_add (twice_load, fix_int (1))),
+                                    t->recent_cpu),
+                           fix_int (t->nice));
+  mlfqs_mark_dirty (t);
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
@@ -390,6 +643,11 @@ idle (void *idle_started_ UNUSED)
 {
   struct semaphore *idle_started = idle_started_;
   idle_thread = thread_current ();
+
+  /* The idle thread runs only when nothing else is ready, whatever
+     priority the MLFQS formula would give it. */
+  idle_thread->priority = idle_thread->base_priority = PRI_MIN;
+
   sema_up (idle_started);
 
   for (;;)
@@ -461,7 +719,18 @@ init_thread (struct thread *t, const char *name, int priority)
   t->status = THREAD_BLOCKED;
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
+  if (thread_mlfqs)
+    {
+      /* Threads inherit nice and recent_cpu from their parent.  The
+         initial thread is its own "parent" here, and starts at 0. */
+      struct thread *parent = running_thread ();
+      t->nice = parent->nice;
+      t->recent_cpu = parent->recent_cpu;
+      priority = mlfqs_priority (t);
+    }
   t->priority = priority;
+  t->base_priority = priority;
+  list_init (&t->held_locks);
   t->magic = THREAD_MAGIC;
 
   old_level = intr_disable ();
@@ -482,18 +751,87 @@ alloc_frame (struct thread *t, size_t size)
   return t->stack;
 }
 
-/* Chooses and returns the next thread to be scheduled.  Should
-   return a thread from the run queue, unless the run queue is
-   empty.  (If the running thread can continue running, then it
-   will be in the run queue.)  If the run queue is empty, return
+/* Adds T to the back of the run queue for its priority. */
+static void
+ready_list_push (struct thread *t)
+{
+  list_push_back (&ready_lists[t->priority], &t->elem);
+  ready_levels |= (uint64_t) 1 << t->priority;
+  ready_count++;
+}
+
+/* Takes ready thread T off its run queue. */
+static void
+ready_list_remove (struct thread *t)
+{
+  list_remove (&t->elem);
+  if (list_empty (&ready_lists[t->priority]))
+    ready_levels &= ~((uint64_t) 1 << t->priority);
+  ready_count--;
+}
+
+/* Sets T's effective priority to PRIORITY, moving T to the
+   matching run queue if it is ready, or to its new place among a
+   semaphore's waiters if it is waiting for one. */
+static void
+set_effective_priority (struct thread *t, int priority)
+{
+  if (priority == t->priority)
+    return;
+  if (t->status == THREAD_READY)
+    {
+      ready_list_remove (t);
+      t->priority = priority;
+      ready_list_push (t);
+    }
+  else if (t->status == THREAD_BLOCKED && t->wait_queue != NULL)
+    {
+      list_remove (&t->elem);
+      t->priority = priority;
+      list_insert_ordered (t->wait_queue, &t->elem,
+                           thread_priority_greater, NULL);
+    }
+  else
+    t->priority = priority;
+}
+
+/* Returns the highest priority of any ready thread, or -1 if no
+   thread is ready. */
+static int
+highest_ready_priority (void)
+{
+  uint32_t high = ready_levels >> 32;
+  uint32_t low = ready_levels;
+
+  if (high != 0)
+    return 63 - __builtin_clz (high);
+  else if (low != 0)
+    return 31 - __builtin_clz (low);
+  else
+    return -1;
+}
+
+/* Chooses and returns the next thread to be scheduled: the
+   thread at the front of the highest-priority non-empty run
+   queue.  (If the running thread can continue running, then it
+   will be in a run queue.)  If every run queue is empty, return
    idle_thread. */
 static struct thread *
 next_thread_to_run (void)
 {
-  if (list_empty (&ready_list))
+  int priority = highest_ready_priority ();
+  struct list *queue;
+  struct thread *t;
+
+  if (priority < PRI_MIN)
     return idle_thread;
-  else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+
+  queue = &ready_lists[priority];
+  t = list_entry (list_pop_front (queue), struct thread, elem);
+  if (list_empty (queue))
+    ready_levels &= ~((uint64_t) 1 << priority);
+  ready_count--;
+  return t;
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -522,6 +860,24 @@ thread_schedule_tail (struct thread *prev)
   /* Mark us as running. */
   cur->status = THREAD_RUNNING;
 
+  /* Account for the time we spent waiting to run. */
+  if (prev != NULL)
+    {
+      uint64_t now = read_tsc ();
+      uint64_t waited = now - cur->ready_since;
+
+      cur->ready_cycles += waited;
+      if (cur->woken)
+        {
+          if (waited > cur->max_wakeup_latency)
+            cur->max_wakeup_latency = waited;
+          if (waited > max_wakeup_latency)
+            max_wakeup_latency = waited;
+          cur->woken = false;
+        }
+      cur->run_since = now;
+    }
+
   /* Start new time slice. */
   thread_ticks = 0;
 
@@ -561,7 +917,23 @@ schedule (void)
   ASSERT (is_thread (next));
 
   if (cur != next)
-    prev = switch_threads (cur, next);
+    {
+      /* A thread that blocks or exits gives up the CPU
+         voluntarily; one that is still ready was preempted or
+         yielded. */
+      cur->run_cycles += read_tsc () - cur->run_since;
+      if (cur->status == THREAD_READY)
+        {
+          cur->involuntary_switches++;
+          involuntary_switches++;
+        }
+      else
+        {
+          cur->voluntary_switches++;
+          voluntary_switches++;
+        }
+      prev = switch_threads (cur, next);
+    }
   thread_schedule_tail (prev);
 }
 
@@ -26,6 +26,11 @@ typedef int tid_t;
 #define PRI_DEFAULT 31                  /* Default priority. */
 #define PRI_MAX 63                      /* Highest priority. */
 
+/* Thread nice values, for the MLFQS scheduler. */
+#define NICE_MIN -20                    /* Nicest to other threads. */
+#define NICE_DEFAULT 0                  /* Default nice value. */
+#define NICE_MAX 20                     /* Least nice. */
+
 /* A kernel thread or user process.
 
    Each thread structure is stored in its own 4 kB page.  The
@@ -89,12 +94,35 @@ struct thread
     enum thread_status status;          /* Thread state. */
     char name[16];                      /* Name (for debugging purposes). */
     uint8_t *stack;                     /* Saved stack pointer. */
-    int priority;                       /* Priority. */
+    int priority;                       /* Effective priority. */
+    int base_priority;                  /* Priority before donations. */
+    struct list held_locks;             /* Locks held, for donations. */
+    struct lock *waiting_lock;          /* Lock being waited for, if any. */
+    struct list *wait_queue;            /* Semaphore's waiters, if waiting. */
     struct list_elem allelem;           /* List element for all threads list. */
 
+    /* Owned by thread.c, for the MLFQS scheduler. */
+    int nice;                           /* Niceness. */
+    fixed_point_t recent_cpu;           /* Recent CPU time received. */
+    bool mlfqs_dirty;                   /* Priority due for an update? */
+    struct list_elem dirtyelem;         /* Element in mlfqs_dirty_list. */
+
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
 
+    /* Owned by thread.c, for scheduler statistics (in cycles). */
+    uint64_t ready_since;               /* When last made ready. */
+    uint64_t run_since;                 /* When last scheduled. */
+    uint64_t ready_cycles;              /* Total time spent ready. */
+    uint64_t run_cycles;                /* Total time spent running. */
+    uint64_t max_wakeup_latency;        /* Longest unblock-to-run time. */
+    unsigned voluntary_switches;        /* # of times it blocked or exited. */
+    unsigned involuntary_switches;      /* # of times it yielded. */
+    bool woken;                         /* Made ready by thread_unblock()? */
+
+    /* Owned by devices/timer.c. */
+    int64_t wakeup_tick;                /* Tick to wake up at, if asleep. */
+
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
@@ -104,7 +132,7 @@ struct thread
     unsigned magic;                     /* Detects stack overflow. */
   };
 
-/* If false (default), use round-robin scheduler.
+/* If false (default), use priority scheduler.
    If true, use multi-level feedback queue scheduler.
    Controlled by kernel command-line option "-o mlfqs". */
 extern bool thread_mlfqs;
@@ -127,6 +155,7 @@ const char *thread_name (void);
 
 void thread_exit (void) NO_RETURN;
 void thread_yield (void);
+void thread_check_preemption (void);
 
 /* Performs some operation on thread t, given auxiliary data AUX. */
 typedef void thread_action_func (struct thread *t, void *aux);
@@ -134,6 +163,9 @@ void thread_foreach (thread_action_func *, void *);
 
 int thread_get_priority (void);
 void thread_set_priority (int);
+void thread_recompute_priority (struct thread *);
+bool thread_priority_greater (const struct list_elem *,
+                              const struct list_elem *, void *aux);
 
 int thread_get_nice (void);
 void thread_set_nice (int);